@@ -16,91 +16,57 @@
 
 #define _XOPEN_SOURCE 700
 
-#include <fcntl.h>
 #include <stdio.h>
-#include <dirent.h>
-#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <sys/poll.h>
-#include <sys/stat.h>
-#include <sys/types.h>
+#include <sys/ioctl.h>
 
 #include <linux/input.h>
 
 #include "minui.h"
 
-#define MAX_DEVICES	16
-#define MAX_MISC_FDS	16
+/* The ev_ functions of the original minui, on top of the event core in
+ * evloop.c: the devices are watched, not scanned once, and only the fds
+ * that are ready are dispatched. */
 
 #define BITS_PER_LONG		(sizeof(unsigned long) * 8)
 #define BITS_TO_LONGS(x)	(((x) + BITS_PER_LONG - 1) / BITS_PER_LONG)
 
 #define test_bit(bit, array) \
-	((array)[(bit) / BITS_PER_LONG] & (1 << ((bit) % BITS_PER_LONG)))
+	((array)[(bit) / BITS_PER_LONG] & (1UL << ((bit) % BITS_PER_LONG)))
 
-struct fd_info {
-	ev_callback cb;
-	void *data;
-};
+/* ------------------------------------------------------------------------ */
+
+/* TODO: add ability to specify event masks. For now, just assume that only
+ * EV_KEY and EV_REL event types are ever needed. */
+static int
+ev_filter(int fd, const char *path)
+{
+	unsigned long ev_bits[BITS_TO_LONGS(EV_MAX)];
+
+	(void)path;
+
+	/* read the evbits of the input device */
+	if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) < 0)
+		return -1;
 
-static struct pollfd ev_fds[MAX_DEVICES + MAX_MISC_FDS];
-static struct fd_info ev_fdinfo[MAX_DEVICES + MAX_MISC_FDS];
+	if (!test_bit(EV_KEY, ev_bits) && !test_bit(EV_REL, ev_bits))
+		return -1;
 
-static unsigned ev_count = 0;
-static unsigned ev_dev_count = 0;
-static unsigned ev_misc_count = 0;
+	return 0;
+}
 
 /* ------------------------------------------------------------------------ */
 
 int
 ev_init(ev_callback input_cb, void *data)
 {
-	DIR *dir;
-	struct dirent *de;
-	int fd;
-
-	if ((dir = opendir("/dev/input"))) {
-		while ((de = readdir(dir))) {
-			unsigned long ev_bits[BITS_TO_LONGS(EV_MAX)];
-
-/*			fprintf(stderr,"/dev/input/%s\n", de->d_name);*/
-			if (strncmp(de->d_name, "event", 5))
-				continue;
-
-			if ((fd = openat(dirfd(dir), de->d_name,
-					 O_RDONLY)) < 0)
-				continue;
-
-			/* read the evbits of the input device */
-			if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)),
-				  ev_bits) < 0) {
-				close(fd);
-				continue;
-			}
-
-			/* TODO: add ability to specify event masks. For now,
-			 * just assume that only EV_KEY and EV_REL event types
-			 * are ever needed. */
-			if (!test_bit(EV_KEY, ev_bits) &&
-			    !test_bit(EV_REL, ev_bits)) {
-				close(fd);
-				continue;
-			}
-
-			ev_fds[ev_count].fd = fd;
-			ev_fds[ev_count].events = POLLIN;
-			ev_fdinfo[ev_count].cb = input_cb;
-			ev_fdinfo[ev_count].data = data;
-			ev_count++;
-			ev_dev_count++;
-			if (ev_dev_count == MAX_DEVICES)
-				break;
-		}
-	}
+	if (evloop_init())
+		return -1;
 
-	return 0;
+	return evloop_watch_input(ev_filter, input_cb, data);
 }
 
 /* ------------------------------------------------------------------------ */
@@ -108,16 +74,7 @@ ev_init(ev_callback input_cb, void *data)
 int
 ev_add_fd(int fd, ev_callback cb, void *data)
 {
-	if (ev_misc_count == MAX_MISC_FDS || !cb)
-		return -1;
-
-	ev_fds[ev_count].fd = fd;
-	ev_fds[ev_count].events = POLLIN;
-	ev_fdinfo[ev_count].cb = cb;
-	ev_fdinfo[ev_count].data = data;
-	ev_count++;
-	ev_misc_count++;
-	return 0;
+	return evloop_add_fd(fd, cb, data);
 }
 
 /* ------------------------------------------------------------------------ */
@@ -125,11 +82,7 @@ ev_add_fd(int fd, ev_callback cb, void *data)
 void
 ev_exit(void)
 {
-	while (ev_count > 0)
-		close(ev_fds[--ev_count].fd);
-
-	ev_misc_count = 0;
-	ev_dev_count = 0;
+	evloop_exit();
 }
 
 /* ------------------------------------------------------------------------ */
@@ -137,10 +90,7 @@ ev_exit(void)
 int
 ev_wait(int timeout)
 {
-	int r;
-
-	r = poll(ev_fds, ev_count, timeout);
-	if (r <= 0)
+	if (evloop_wait(timeout) <= 0)
 		return -1;
 
 	return 0;
@@ -151,14 +101,7 @@ ev_wait(int timeout)
 void
 ev_dispatch(void)
 {
-	unsigned n;
-
-	for (n = 0; n < ev_count; n++) {
-		ev_callback cb = ev_fdinfo[n].cb;
-		if (cb && (ev_fds[n].revents & ev_fds[n].events))
-			cb(ev_fds[n].fd, ev_fds[n].revents,
-			   ev_fdinfo[n].data);
-	}
+	evloop_dispatch();
 }
 
 /* ------------------------------------------------------------------------ */
@@ -179,34 +122,42 @@ ev_get_input(int fd, short revents, struct input_event *ev)
 
 /* ------------------------------------------------------------------------ */
 
-int
-ev_sync_key_state(ev_set_key_callback set_key_cb, void *data)
+struct sync_key_state {
+	ev_set_key_callback cb;
+	void *data;
+};
+
+static int
+ev_sync_device(int fd, void *arg)
 {
 	unsigned long key_bits[BITS_TO_LONGS(KEY_MAX)];
 	unsigned long ev_bits[BITS_TO_LONGS(EV_MAX)];
-	unsigned i;
-	int ret;
+	struct sync_key_state *sync = arg;
+	int code, ret;
 
-	for (i = 0; i < ev_dev_count; i++) {
-		int code;
+	memset(key_bits, 0, sizeof(key_bits));
+	memset(ev_bits, 0, sizeof(ev_bits));
 
-		memset(key_bits, 0, sizeof(key_bits));
-		memset(ev_bits, 0, sizeof(ev_bits));
+	ret = ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits);
+	if (ret < 0 || !test_bit(EV_KEY, ev_bits))
+		return 0;
 
-		ret = ioctl(ev_fds[i].fd, EVIOCGBIT(0, sizeof(ev_bits)),
-			    ev_bits);
-		if (ret < 0 || !test_bit(EV_KEY, ev_bits))
-			continue;
+	ret = ioctl(fd, EVIOCGKEY(sizeof(key_bits)), key_bits);
+	if (ret < 0)
+		return 0;
 
-		ret = ioctl(ev_fds[i].fd, EVIOCGKEY(sizeof(key_bits)),
-			    key_bits);
-		if (ret < 0)
-			continue;
+	for (code = 0; code <= KEY_MAX; code++)
+		if (test_bit(code, key_bits))
+			sync->cb(code, 1, sync->data);
 
-		for (code = 0; code <= KEY_MAX; code++)
-			if (test_bit(code, key_bits))
-				set_key_cb(code, 1, data);
-	}
+	return 0;
+}
+
+int
+ev_sync_key_state(ev_set_key_callback set_key_cb, void *data)
+{
+	struct sync_key_state sync = { set_key_cb, data };
 
+	evloop_for_each_input(ev_sync_device, &sync);
 	return 0;
 }
@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2023, Roberto A. Foglietta <roberto.foglietta@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+
+#include "minui.h"
+
+#define EVLOOP_INPUT_DIR	"/dev/input"
+#define EVLOOP_INPUT_PREFIX	"event"
+#define EVLOOP_MAX_READY	32
+
+typedef struct evloop_source {
+	int fd;			/* -1 once removed */
+	ev_callback cb;
+	void *data;
+	char *path;		/* of an input device, NULL for the others */
+	struct evloop_source *next;
+} evloop_source;
+
+static int evloop_fd = -1;
+static evloop_source *evloop_sources;
+
+/* Removed while the events of a wait may still point to them, they are
+ * freed after the dispatch. */
+static evloop_source *evloop_dead;
+
+static struct epoll_event evloop_ready[EVLOOP_MAX_READY];
+static int evloop_num_ready;
+
+static struct {
+	ev_device_filter filter;
+	ev_callback cb;
+	void *data;
+} evloop_input;
+
+/* ------------------------------------------------------------------------ */
+
+int
+evloop_init(void)
+{
+	if (evloop_fd >= 0)
+		return 0;
+
+	if ((evloop_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static evloop_source *
+evloop_add(int fd, ev_callback cb, void *data, const char *path)
+{
+	struct epoll_event ev;
+	evloop_source *s;
+
+	if (evloop_fd < 0 && evloop_init())
+		return NULL;
+
+	if (!(s = calloc(1, sizeof(*s))) ||
+	    (path && !(s->path = strdup(path)))) {
+		perror("can't allocate an event source");
+		free(s);
+		return NULL;
+	}
+
+	s->fd = fd;
+	s->cb = cb;
+	s->data = data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	if (epoll_ctl(evloop_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll_ctl");
+		free(s->path);
+		free(s);
+		return NULL;
+	}
+
+	s->next = evloop_sources;
+	evloop_sources = s;
+	return s;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Unlinks s and closes its fd if asked, it is freed after the dispatch */
+static void
+evloop_remove(evloop_source *s, bool do_close)
+{
+	evloop_source **p;
+
+	for (p = &evloop_sources; *p; p = &(*p)->next)
+		if (*p == s) {
+			*p = s->next;
+			break;
+		}
+
+	epoll_ctl(evloop_fd, EPOLL_CTL_DEL, s->fd, NULL);
+	if (do_close)
+		close(s->fd);
+	s->fd = -1;
+
+	s->next = evloop_dead;
+	evloop_dead = s;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+evloop_free_dead(void)
+{
+	evloop_source *s;
+
+	while ((s = evloop_dead)) {
+		evloop_dead = s->next;
+		free(s->path);
+		free(s);
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+
+int
+evloop_add_fd(int fd, ev_callback cb, void *data)
+{
+	if (!cb)
+		return -1;
+
+	return evloop_add(fd, cb, data, NULL) ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+int
+evloop_del_fd(int fd)
+{
+	evloop_source *s;
+
+	for (s = evloop_sources; s; s = s->next)
+		if (s->fd == fd) {
+			evloop_remove(s, false);
+			return 0;
+		}
+
+	return -1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static evloop_source *
+evloop_find_input(const char *path)
+{
+	evloop_source *s;
+
+	for (s = evloop_sources; s; s = s->next)
+		if (s->path && !strcmp(s->path, path))
+			return s;
+
+	return NULL;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Open the device if it isn't yet and the filter accepts it. It may be
+ * created without the permissions yet, IN_ATTRIB tries it again. */
+static void
+evloop_open_input(const char *name)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (strncmp(name, EVLOOP_INPUT_PREFIX, strlen(EVLOOP_INPUT_PREFIX)))
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", EVLOOP_INPUT_DIR, name);
+	if (evloop_find_input(path))
+		return;
+
+	if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		return;
+
+	if (evloop_input.filter && evloop_input.filter(fd, path) == -1) {
+		close(fd);
+		return;
+	}
+
+	if (!evloop_add(fd, evloop_input.cb, evloop_input.data, path))
+		close(fd);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+evloop_close_input(const char *name)
+{
+	char path[PATH_MAX];
+	evloop_source *s;
+
+	snprintf(path, sizeof(path), "%s/%s", EVLOOP_INPUT_DIR, name);
+	if ((s = evloop_find_input(path)))
+		evloop_remove(s, true);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+evloop_scan_input(void)
+{
+	struct dirent *de;
+	DIR *dir;
+
+	if (!(dir = opendir(EVLOOP_INPUT_DIR))) {
+		perror(EVLOOP_INPUT_DIR);
+		return;
+	}
+
+	while ((de = readdir(dir)))
+		evloop_open_input(de->d_name);
+
+	closedir(dir);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+evloop_inotify(int fd, short revents, void *data)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	(void)revents;
+	(void)data;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW)
+				evloop_scan_input();
+			if (!ev->len)
+				continue;
+			if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+				evloop_close_input(ev->name);
+			else if (ev->mask & (IN_CREATE | IN_ATTRIB | IN_MOVED_TO))
+				evloop_open_input(ev->name);
+		}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+int
+evloop_watch_input(ev_device_filter filter, ev_callback cb, void *data)
+{
+	int fd;
+
+	if (!cb || evloop_input.cb || (evloop_fd < 0 && evloop_init()))
+		return -1;
+
+	evloop_input.filter = filter;
+	evloop_input.cb = cb;
+	evloop_input.data = data;
+
+	/* Before the scan, not to miss a device created in between */
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, EVLOOP_INPUT_DIR, IN_CREATE |
+				     IN_ATTRIB | IN_DELETE | IN_MOVED_TO |
+				     IN_MOVED_FROM) < 0 ||
+	    !evloop_add(fd, evloop_inotify, NULL, NULL)) {
+		perror("can't watch " EVLOOP_INPUT_DIR ", no hotplug");
+		if (fd >= 0)
+			close(fd);
+	}
+
+	evloop_scan_input();
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+int
+evloop_for_each_input(int (*fn)(int fd, void *data), void *data)
+{
+	evloop_source *s;
+	int ret;
+
+	for (s = evloop_sources; s; s = s->next)
+		if (s->path && (ret = fn(s->fd, data)))
+			return ret;
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+int
+evloop_wait(int timeout)
+{
+	int n;
+
+	evloop_num_ready = 0;
+	if (evloop_fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	n = epoll_wait(evloop_fd, evloop_ready, EVLOOP_MAX_READY, timeout);
+	if (n > 0)
+		evloop_num_ready = n;
+
+	return n;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+evloop_dispatch(void)
+{
+	int i;
+
+	for (i = 0; i < evloop_num_ready; i++) {
+		evloop_source *s = evloop_ready[i].data.ptr;
+		uint32_t events = evloop_ready[i].events;
+
+		if (s->fd < 0)
+			continue;
+
+		/* An input device unplugged, before its node is deleted */
+		if (s->path && (events & (EPOLLERR | EPOLLHUP))) {
+			evloop_remove(s, true);
+			continue;
+		}
+
+		s->cb(s->fd, events, s->data);
+	}
+
+	evloop_num_ready = 0;
+	evloop_free_dead();
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+evloop_exit(void)
+{
+	while (evloop_sources)
+		evloop_remove(evloop_sources, true);
+	evloop_free_dead();
+
+	memset(&evloop_input, 0, sizeof(evloop_input));
+	evloop_num_ready = 0;
+
+	if (evloop_fd >= 0)
+		close(evloop_fd);
+	evloop_fd = -1;
+}
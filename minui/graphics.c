@@ -24,17 +24,20 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 
 #include <linux/fb.h>
 #include <linux/kd.h>
 
-#include "font_10x18.h"
+#include "font_atlas.h"
 #include "minui.h"
 #include "graphics.h"
+#include "../trace.h"
 
 #define MSTIME_HEADER_ONLY
 #define MSTIME_STATIC_VARS
@@ -44,9 +47,53 @@ typedef struct {
 	GRSurface *texture;
 	int cwidth;
 	int cheight;
+	/* 1-bpp glyph table of a PSF console font, used when !texture */
+	const uint8_t *glyphs;
+	int glyph_bytes;
+	int glyph_row_bytes;
+	int glyph_count;
+	/* codepoint to glyph + 1, pages of 256 codepoints of the BMP */
+	uint16_t **index;
+	/* the ASCII codepoints need no lookup */
+	bool ascii_direct;
+	void *map;
+	size_t map_size;
 } GRFont;
 
+#define PSF1_MAGIC0	0x36
+#define PSF1_MAGIC1	0x04
+#define PSF1_MODE512	0x01
+#define PSF1_MODEHASTAB	0x02
+#define PSF1_MODESEQ	0x04
+#define PSF2_MAGIC	0x864ab572
+#define PSF2_HAS_UNICODE_TABLE 0x01
+
+#define GLYPH_PAGES	256
+#define GLYPH_PAGE_SIZE	256
+
+struct psf2_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t headersize;
+	uint32_t flags;
+	uint32_t length;
+	uint32_t charsize;
+	uint32_t height;
+	uint32_t width;
+};
+
+/* gr_font is the smallest font, the one factor 1 refers to */
 static GRFont *gr_font = NULL;
+static pthread_once_t gr_font_once = PTHREAD_ONCE_INIT;
+static GRFont gr_fonts[FONT_ATLAS_COUNT];
+static GRSurface gr_font_textures[FONT_ATLAS_COUNT];
+static int gr_font_count = 0;
+
+/* Provides the non ASCII glyphs that the font lacks, mapped on first use */
+static const char gr_ext_font_path[] = "/res/images/font.psf";
+static GRFont gr_ext_font;
+static int gr_ext_font_state = 0; /* 0 not tried, 1 loaded, -1 missing */
+
 static minui_backend *gr_backend = NULL;
 
 static int overscan_percent  = OVERSCAN_PERCENT;
@@ -62,8 +109,13 @@ static uint8_t gr_current_a;
 static uint32_t gr_current_rgba;
 
 static GRSurface *gr_draw = NULL;
+static unsigned gr_frames = 0;
+
+/* Rows of gr_draw drawn since the last flip, empty when y1 >= y2 */
+static int gr_damage_y1 = 0;
+static int gr_damage_y2 = 0;
 
-extern long long int v_shift;
+long long int v_shift = 0;
 
 /* ------------------------------------------------------------------------ */
 
@@ -75,16 +127,50 @@ outside(int x, int y)
 
 /* ------------------------------------------------------------------------ */
 
+static void
+gr_damage(int y1, int y2)
+{
+	gr_stats_stamp(GR_DRAW_START);
+
+	if (gr_damage_y1 >= gr_damage_y2) {
+		gr_damage_y1 = y1;
+		gr_damage_y2 = y2;
+		return;
+	}
+
+	if (y1 < gr_damage_y1)
+		gr_damage_y1 = y1;
+	if (y2 > gr_damage_y2)
+		gr_damage_y2 = y2;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int gr_text_width(GRFont *font, int scale, const char *s,
+			 const char *end);
+
+/* The font is set up when the first text is measured or drawn, unless
+ * gr_init_font() was already called, e.g. from a helper thread: then it
+ * waits for that one to complete. */
+static GRFont *
+gr_font_get(void)
+{
+	gr_init_font();
+	return gr_font;
+}
+
+/* ------------------------------------------------------------------------ */
+
 int gr_measure(const char *s)
 {
-    return gr_font->cwidth * strlen(s);
+    return gr_text_width(gr_font_get(), 1, s, s + strlen(s));
 }
 
 /* ------------------------------------------------------------------------ */
 
 void gr_font_size(int *x, int *y)
 {
-    *x = gr_font->cwidth;
+    *x = gr_font_get()->cwidth;
     *y = gr_font->cheight;
 }
 
@@ -157,14 +243,467 @@ char_blend(uint8_t *sx, uint32_t src_row_bytes, uint8_t *px, uint8_t *bx,
 
 /* ------------------------------------------------------------------------ */
 
+/* Same as char_blend() but for a 1-bpp glyph, MSB first: every bit is
+ * expanded to a factor x factor block, the background is left untouched. */
+static void
+bits_blend(const uint8_t *sx, uint32_t src_row_bytes, uint8_t *px, uint8_t *bx,
+    uint32_t dst_row_bytes, uint32_t width, uint32_t height, uint32_t factor)
+{
+	uint_fast32_t i, j, l, k, z;
+	uint32_t *wpx;
+
+	for (j = 0; j < height; j++) {
+		for (l = 0; l < factor; l++) {
+			wpx = (uint32_t *)px;
+
+			for (i = 0; i < width; i++) {
+				uint8_t b = sx[i >> 3];
+
+				if (!b) {
+					i |= 7; /* skip the whole empty byte */
+					continue;
+				}
+				if (!(b & (0x80 >> (i & 7))))
+					continue;
+
+				for (z = i * factor, k = 0; k < factor; k++, z++) {
+					if (gr_current_a == 255) {
+						wpx[z] = gr_current_rgba;
+					} else {
+						int h = z << 2;
+						px[h+0] = alpha_apply(px[h+0], gr_current_r, gr_current_a);
+						px[h+1] = alpha_apply(px[h+1], gr_current_g, gr_current_a);
+						px[h+2] = alpha_apply(px[h+2], gr_current_b, gr_current_a);
+					}
+				}
+			}
+
+			if (bx) {
+				memcpy(bx, px, (width * factor) << 2);
+				bx += dst_row_bytes;
+			}
+			px += dst_row_bytes;
+		}
+		sx += src_row_bytes;
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+
 // RAF: (x,y) is the coordinates at which it starts to render the text
 //      the following macro can be useful somewhere else (TODO)
 
-#define gr_draw_data_ptr(x,y) (uint8_t *)(gr_draw_ptr->data + \
-        (x * gr_draw_ptr->pixel_bytes)) + (y * gr_draw_ptr->row_bytes)
+#define gr_draw_data_ptr(x,y) (uint8_t *)(gr_draw->data + \
+        (x * gr_draw->pixel_bytes)) + (y * gr_draw->row_bytes)
+
+/* Pick the font whose cell height, scaled by the smallest integer factor,
+ * is the closest to the requested one. Ties go to the largest font, so a
+ * native size always wins over the blocky integer upscaling. */
+static GRFont *
+gr_font_pick(int factor, int *scale)
+{
+	GRFont *best = gr_font_get();
+	int i, s, err, best_err = -1, want = best->cheight * factor;
+
+	*scale = factor;
+	for (i = gr_font_count - 1; i >= 0; i--) {
+		s = INT_DIV(want, gr_fonts[i].cheight);
+		if (s < 1)
+			s = 1;
+		err = abs(gr_fonts[i].cheight * s - want);
+		if (best_err < 0 || err < best_err) {
+			best_err = err;
+			best = &gr_fonts[i];
+			*scale = s;
+		}
+	}
+
+	return best;
+}
+
+/* Decode the next UTF-8 sequence, a malformed one becomes U+FFFD. */
+static uint32_t
+utf8_next(const uint8_t **ps)
+{
+	const uint8_t *s = *ps;
+	uint32_t c = *s++;
+	int n;
+
+	if (c < 0x80)
+		n = 0;
+	else if ((c & 0xe0) == 0xc0)
+		c &= 0x1f, n = 1;
+	else if ((c & 0xf0) == 0xe0)
+		c &= 0x0f, n = 2;
+	else if ((c & 0xf8) == 0xf0)
+		c &= 0x07, n = 3;
+	else
+		c = 0xfffd, n = 0;
+
+	while (n--) {
+		if ((*s & 0xc0) != 0x80) {
+			c = 0xfffd;
+			break;
+		}
+		c = (c << 6) | (*s++ & 0x3f);
+	}
+
+	*ps = s;
+	return c;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+gr_font_lookup(const GRFont *font, uint32_t c)
+{
+	const uint16_t *page;
+
+	if (!font->glyphs)
+		return (c >= 32 && c < 128) ? (int)c - 32 : -1;
+
+	/* Without a unicode table only ASCII is known to be where its code
+	 * is, the glyphs above are of an unknown codepage */
+	if (!font->index)
+		return (c < 0x80 && c < (uint32_t)font->glyph_count) ?
+		       (int)c : -1;
+
+	if (c >= GLYPH_PAGES * GLYPH_PAGE_SIZE ||
+	    !(page = font->index[c / GLYPH_PAGE_SIZE]))
+		return -1;
+
+	return (int)page[c % GLYPH_PAGE_SIZE] - 1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static bool gr_ext_font_get(void);
+
+/* Decode the next character of s and map it to a glyph. The ASCII ones are
+ * mapped without any lookup, the others through the two-level font index,
+ * falling back to the extended font with its own scale and vertical offset
+ * to share the baseline. Returns the glyph, -1 if there is nothing to draw,
+ * and moves s past the character. */
+static inline int
+gr_next_glyph(const char **s, GRFont **font, int *scale, int *dy)
+{
+	GRFont *f = *font;
+	uint32_t c = (uint8_t)**s;
+	int glyph, h;
+
+	if (c < 0x80 && f->ascii_direct) {
+		(*s)++;
+		return f->glyphs ? (int)c : (int)c - 32;
+	}
+
+	c = utf8_next((const uint8_t **)s);
+	if ((glyph = gr_font_lookup(f, c)) >= 0)
+		return glyph;
+
+	if (c >= 0x80 && gr_ext_font_get() &&
+	    (glyph = gr_font_lookup(&gr_ext_font, c)) >= 0) {
+		h = f->cheight * *scale;
+		*font = &gr_ext_font;
+		/* Rounded down, not to be taller than the run */
+		*scale = h / gr_ext_font.cheight;
+		if (*scale < 1)
+			*scale = 1;
+		*dy = h - gr_ext_font.cheight * *scale;
+		if (*dy < 0)
+			*dy = 0;
+		return glyph;
+	}
+
+	return gr_font_lookup(f, '?');
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+gr_text_width(GRFont *font, int scale, const char *s, const char *end)
+{
+	int w = 0;
+
+	while (s < end) {
+		GRFont *gf = font;
+		int gs = scale, dy;
+
+		gr_next_glyph(&s, &gf, &gs, &dy);
+		w += gf->cwidth * gs;
+	}
+
+	return w;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Text surfaces: a run of text is rendered once into its alpha mask, with
+ * the current alpha already applied, and then the mask is blitted by spans
+ * of the same kind: the opaque ones are plain stores of the current colour
+ * and only the anti-aliased edges are blended. The surfaces are cached by
+ * (string, factor, bold, colour), so a text that stays on the screen while
+ * the frames change is rendered only the first time. */
+
+#define TEXT_CACHE_SIZE 16
+
+typedef struct {
+	uint16_t x;
+	uint16_t len;
+	bool opaque;
+} text_span;
+
+typedef struct {
+	char *text;
+	int len;
+	int factor;
+	int bold;
+	uint32_t rgba;
+	int width;
+	int height;
+	uint8_t *alpha;
+	int *row_spans;		/* height + 1 indexes into spans */
+	text_span *spans;
+	int num_glyphs;
+	int *glyph_end;		/* right edge of every glyph */
+} text_surface;
+
+static text_surface text_cache[TEXT_CACHE_SIZE];
+static unsigned text_cache_next = 0;
+
+/* ------------------------------------------------------------------------ */
+
+static void
+text_surface_free(text_surface *ts)
+{
+	free(ts->text);
+	free(ts->alpha);
+	free(ts->row_spans);
+	free(ts->spans);
+	free(ts->glyph_end);
+	memset(ts, 0, sizeof(*ts));
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+gr_text_cache_flush(void)
+{
+	unsigned i;
+
+	for (i = 0; i < TEXT_CACHE_SIZE; i++)
+		text_surface_free(&text_cache[i]);
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Expand a glyph, 1-bpp or 8-bit alpha, into the factor x factor blocks of
+ * the mask. */
+static void
+glyph_coverage(uint8_t *dp, int dst_row_bytes, int rows, const GRFont *f,
+	       int glyph, int bold, int factor)
+{
+	const uint8_t *sp;
+	int i, j, l, src_row_bytes;
+	uint8_t a;
+
+	if (f->glyphs) {
+		sp = f->glyphs + glyph * f->glyph_bytes;
+		src_row_bytes = f->glyph_row_bytes;
+	} else {
+		src_row_bytes = f->texture->row_bytes;
+		sp = f->texture->data + glyph * f->cwidth +
+		     (bold ? f->cheight * src_row_bytes : 0);
+	}
+
+	/* At most rows of dp, a fallback glyph may be taller than the run */
+	for (j = 0; j < f->cheight; j++, sp += src_row_bytes)
+		for (l = 0; l < factor && rows > 0;
+		     l++, rows--, dp += dst_row_bytes)
+			for (i = 0; i < f->cwidth; i++) {
+				if (f->glyphs)
+					a = (sp[i >> 3] & (0x80 >> (i & 7))) ? 255 : 0;
+				else
+					a = sp[i];
+				if (a)
+					memset(dp + i * factor, a, factor);
+			}
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+text_add_span(text_surface *ts, int *cap, int n, int x, int len, bool opaque)
+{
+	text_span *span;
+
+	if (n == *cap) {
+		int c = *cap ? *cap * 2 : 64;
+
+		if (!(span = realloc(ts->spans, c * sizeof(*span))))
+			return -1;
+		ts->spans = span;
+		*cap = c;
+	}
+
+	span = &ts->spans[n];
+	span->x = x;
+	span->len = len;
+	span->opaque = opaque;
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
 
-#define gr_flip_data_ptr(x,y) (uint8_t *)(gr_flip_ptr->data + \
-        (x * gr_flip_ptr->pixel_bytes)) + (y * gr_flip_ptr->row_bytes)
+static int
+text_render(text_surface *ts, GRFont *font, int scale, const char *s, int bold)
+{
+	const char *end = s + ts->len;
+	int x = 0, y, i, n = 0, cap = 0;
+	uint8_t *p;
+
+	ts->width = gr_text_width(font, scale, s, end);
+	ts->height = font->cheight * scale;
+	if (ts->width <= 0 || ts->width > UINT16_MAX)
+		return -1;
+
+	if (!(ts->alpha = calloc(ts->height, ts->width)) ||
+	    !(ts->row_spans = malloc((ts->height + 1) * sizeof(int))) ||
+	    !(ts->glyph_end = malloc(ts->len * sizeof(int))))
+		return -1;
+
+	while (s < end) {
+		GRFont *gf = font;
+		int gs = scale, dy = 0;
+		int glyph = gr_next_glyph(&s, &gf, &gs, &dy);
+
+		if (glyph >= 0)
+			glyph_coverage(ts->alpha + dy * ts->width + x, ts->width,
+				       ts->height - dy, gf, glyph, bold, gs);
+		x += gf->cwidth * gs;
+		ts->glyph_end[ts->num_glyphs++] = x;
+	}
+
+	/* Apply the current alpha and split every row in spans of opaque
+	 * or translucent pixels, the transparent ones are skipped. */
+	for (y = 0, p = ts->alpha; y < ts->height; y++, p += ts->width) {
+		ts->row_spans[y] = n;
+		for (x = 0; x < ts->width; x = i) {
+			bool opaque;
+
+			if (!p[x]) {
+				i = x + 1;
+				continue;
+			}
+
+			opaque = (gr_current_a == 255 && p[x] == 255);
+			for (i = x; i < ts->width && p[i] &&
+			     (gr_current_a == 255 && p[i] == 255) == opaque; i++)
+				if (gr_current_a < 255)
+					p[i] = alpha_apply(0, gr_current_a, p[i]);
+
+			if (text_add_span(ts, &cap, n++, x, i - x, opaque))
+				return -1;
+		}
+	}
+	ts->row_spans[y] = n;
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static text_surface *
+gr_text_surface(GRFont *font, int scale, const char *s, int len, int bold,
+		int factor)
+{
+	unsigned i;
+	text_surface *ts;
+
+	for (i = 0; i < TEXT_CACHE_SIZE; i++) {
+		ts = &text_cache[i];
+		if (ts->text && ts->len == len && ts->factor == factor &&
+		    ts->bold == bold && ts->rgba == gr_current_rgba &&
+		    !memcmp(ts->text, s, len))
+			return ts;
+	}
+
+	ts = &text_cache[text_cache_next++ % TEXT_CACHE_SIZE];
+	text_surface_free(ts);
+
+	if (!(ts->text = malloc(len))) {
+		perror("can't allocate the text surface");
+		return NULL;
+	}
+	memcpy(ts->text, s, len);
+	ts->len = len;
+	ts->factor = factor;
+	ts->bold = bold;
+	ts->rgba = gr_current_rgba;
+
+	if (text_render(ts, font, scale, s, bold)) {
+		text_surface_free(ts);
+		return NULL;
+	}
+
+	return ts;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Blend the surface at (x, y) of dst. Like the glyph by glyph drawing,
+ * it stops at the first glyph that doesn't fit in dst. */
+static void
+text_blit(const text_surface *ts, int x, int y, GRSurface *dst)
+{
+	int i, j, k, w, h;
+	const uint8_t *sp = ts->alpha;
+	uint8_t *px;
+
+	if (x < 0 || y < 0 || y + ts->height > dst->height)
+		return;
+
+	for (w = 0, k = 0; k < ts->num_glyphs; k++) {
+		if (x + ts->glyph_end[k] > dst->width)
+			break;
+		w = ts->glyph_end[k];
+	}
+	h = ts->height;
+
+	px = dst->data + y * dst->row_bytes + x * dst->pixel_bytes;
+	gr_damage(y, y + h);
+
+	for (j = 0; j < h; j++) {
+		uint32_t *wpx = (uint32_t *)px;
+
+		for (k = ts->row_spans[j]; k < ts->row_spans[j + 1]; k++) {
+			const text_span *span = &ts->spans[k];
+			int len = span->len;
+
+			if (span->x >= w)
+				break;
+			if (span->x + len > w)
+				len = w - span->x;
+
+			if (span->opaque) {
+				for (i = span->x; i < span->x + len; i++)
+					wpx[i] = ts->rgba;
+			} else {
+				for (i = span->x; i < span->x + len; i++) {
+					uint8_t a = sp[i], *p = px + (i << 2);
+
+					p[0] = alpha_apply(p[0], gr_current_r, a);
+					p[1] = alpha_apply(p[1], gr_current_g, a);
+					p[2] = alpha_apply(p[2], gr_current_b, a);
+				}
+			}
+		}
+
+		sp += ts->width;
+		px += dst->row_bytes;
+	}
+}
+
+/* ------------------------------------------------------------------------ */
 
 /*
 #ifndef _GET_TIME_MS_H_
@@ -177,28 +716,16 @@ char_blend(uint8_t *sx, uint32_t src_row_bytes, uint8_t *px, uint8_t *bx,
 */
 
 void
-gr_text(int kx, int ky, const char *s, int bold, int factor, int row)
+gr_text_origin(int kx, int ky, int width, int height, int row, int *px, int *py)
 {
-	GRFont *font = gr_font;
-	int off, frch, frcw, x, y, strw = 0;
-
-	if (!font->texture)
-		return;
-
-	if (gr_current_a == 0)
-		return;
-
-    frcw = font->cwidth  * factor;
-    frch = font->cheight * factor;
+	int x, y, strw = 0;
 
-	bold = bold && (font->texture->height != font->cheight);
-	
 	if(kx < 0) {
 	    //RAF: align the text on the right side
 	    kx = -kx; 
 	} else {
 	    //RAF: center the text on the screen
-	    strw = (frcw * strlen(s)) >> 1;
+	    strw = width >> 1;
     }
 
     x = MIL_DIV(gr_draw->width  * kx) + overscan_offset_x - strw;
@@ -207,50 +734,112 @@ gr_text(int kx, int ky, const char *s, int bold, int factor, int row)
     y = MIL_DIV(gr_draw->height * ky) + overscan_offset_y + v_shift;
     if(y < ABSOLUTE_DISPLAY_MARGIN_Y) y = ABSOLUTE_DISPLAY_MARGIN_Y;
         
-    y += (row * frch) - MIL_DIV(frch * ky); //RAF: progressive vertical shift
+    y += (row * height) - MIL_DIV(height * ky); //RAF: progressive vertical shift
 
-	printf("gr_text -> mpl: %d, fnt: %d.%d, off: %d.%d, kxy: %d.%d, pos: %d.%d\n",
-	    factor, font->cwidth, font->cheight, overscan_offset_x,
-	    overscan_offset_y, kx, ky, x, y);
+    *px = x;
+    *py = y;
+}
 
-	m_gettimems = -1;
-	get_ms_time_run();
+/* ------------------------------------------------------------------------ */
 
-    static GRSurface *gr_draw_ptr = NULL, *gr_flip_ptr = NULL;
-#if 1
-    if(!gr_flip_ptr || !gr_draw_ptr) {
-        gr_flip_ptr = gr_flip_n_copy();
-        gr_draw_ptr = gr_draw;
-    }
-#else
-    if(!gr_flip_ptr || !gr_draw_ptr) {
-        gr_save();
-        gr_flip_ptr = gr_flip();
-        gr_restore();
-        gr_draw_ptr = gr_draw;
-    }
-#endif
+int
+gr_glyph_advance(const char **s, int factor)
+{
+	int scale, dy;
+	GRFont *font = gr_font_pick(factor, &scale);
 
-	get_ms_time_run();
+	gr_next_glyph(s, &font, &scale, &dy);
+	return font->cwidth * scale;
+}
 
-	while ((off = *s++)) {
-		if (outside(x + frcw - 1, y + frch - 1))
-			break;
+/* ------------------------------------------------------------------------ */
+
+int
+gr_font_height(int factor)
+{
+	int scale;
+	GRFont *font = gr_font_pick(factor, &scale);
+
+	return font->cheight * scale;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+gr_text_run(int x, int y, const char *s, int len, int bold, int factor)
+{
+	GRFont *font;
+	text_surface *ts;
+	const char *end = s + len;
+	int scale;
 
-		if ((off -= 32) >= 0 && off < 96) {
-			uint8_t *src_p = font->texture->data + (off * font->cwidth) +
-				(bold ? font->cheight * font->texture->row_bytes : 0);
+	if (gr_current_a == 0 || len <= 0)
+		return;
+
+	font = gr_font_pick(factor, &scale);
+	if (!font->texture && !font->glyphs)
+		return;
 
-			char_blend(src_p, font->texture->row_bytes, gr_draw_data_ptr(x, y),
-				   gr_flip_data_ptr(x,y), gr_draw_ptr->row_bytes, font->cwidth,
-				   font->cheight, factor);
+	bold = bold && font->texture && (font->texture->height != font->cheight);
+
+	if ((ts = gr_text_surface(font, scale, s, len, bold, factor))) {
+		text_blit(ts, x, y, gr_draw);
+		return;
+	}
+
+	/* no surface for this text, draw it glyph by glyph */
+	while (s < end) {
+		GRFont *gf = font;
+		int gs = scale, dy = 0, gy, gw;
+		int glyph = gr_next_glyph(&s, &gf, &gs, &dy);
+
+		gw = gf->cwidth * gs;
+		gy = y + dy;
+		if (outside(x + gw - 1, gy + gf->cheight * gs - 1))
+			break;
+		gr_damage(gy, gy + gf->cheight * gs);
+
+		if (glyph < 0) {
+			/* nothing to draw */
+		} else if (gf->glyphs) {
+			bits_blend(gf->glyphs + glyph * gf->glyph_bytes,
+				   gf->glyph_row_bytes, gr_draw_data_ptr(x, gy),
+				   NULL, gr_draw->row_bytes,
+				   gf->cwidth, gf->cheight, gs);
+		} else {
+			uint8_t *src_p = gf->texture->data + (glyph * gf->cwidth) +
+				(bold ? gf->cheight * gf->texture->row_bytes : 0);
+
+			char_blend(src_p, gf->texture->row_bytes, gr_draw_data_ptr(x, gy),
+				   NULL, gr_draw->row_bytes, gf->cwidth,
+				   gf->cheight, gs);
 		}
-		x += frcw;
+		x += gw;
 	}
 }
 
 /* ------------------------------------------------------------------------ */
 
+void
+gr_text(int kx, int ky, const char *s, int bold, int factor, int row)
+{
+	GRFont *font;
+	int x, y, scale, len = strlen(s);
+
+	if (gr_current_a == 0)
+		return;
+
+	font = gr_font_pick(factor, &scale);
+	gr_text_origin(kx, ky, gr_text_width(font, scale, s, s + len),
+		       font->cheight * scale, row, &x, &y);
+
+	TRACE_BEGIN("gr_text");
+	gr_text_run(x, y, s, len, bold, factor);
+	TRACE_END("gr_text");
+}
+
+/* ------------------------------------------------------------------------ */
+
 void
 gr_texticon(int x, int y, GRSurface *icon)
 {
@@ -274,6 +863,7 @@ gr_texticon(int x, int y, GRSurface *icon)
 	src_p = icon->data;
 	dst_p = gr_draw->data + y * gr_draw->row_bytes +
 				x * gr_draw->pixel_bytes;
+	gr_damage(y, y + icon->height);
 
 	char_blend(src_p, icon->row_bytes, dst_p, NULL, gr_draw->row_bytes,
 		   icon->width, icon->height, 1);
@@ -296,6 +886,8 @@ gr_color(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
 void
 gr_clear(void)
 {
+	gr_damage(0, gr_draw->height);
+
 	if (gr_current_r == gr_current_g && gr_current_r == gr_current_b)
 		memset(gr_draw->data, gr_current_r,
 		       gr_draw->height * gr_draw->row_bytes);
@@ -335,6 +927,7 @@ gr_fill(int x1, int y1, int x2, int y2)
 
 	p = gr_draw->data + y1 * gr_draw->row_bytes +
 	    x1 * gr_draw->pixel_bytes;
+	gr_damage(y1, y2);
 
 	if (gr_current_a == 255) {
 		int x, y;
@@ -405,6 +998,7 @@ gr_blit(GRSurface *source, int sx, int sy, int w, int h, int dx, int dy)
 			       sx * source->pixel_bytes;
 	dst_p = gr_draw->data + dy * gr_draw->row_bytes +
 				dx * gr_draw->pixel_bytes;
+	gr_damage(dy, dy + h);
 
 	for (i = 0; i < h; i++) {
 		memcpy(dst_p, src_p, w * source->pixel_bytes);
@@ -438,55 +1032,278 @@ gr_get_height(GRSurface *surface)
 /* ------------------------------------------------------------------------ */
 
 static void
-gr_init_font(void)
+gr_font_setup(void)
 {
-	int res;
-	static const char font_path[] = "/res/images/font.png";
-
-	/* TODO: Check for error */
-	gr_font = calloc(sizeof(*gr_font), 1);
+	int i, res;
+	GRSurface *texture;
+	static const char font_dir[] = "/res/images";
+	static const char font_name[] = "font";
 
-	bool font_loaded = false;
+	if (gr_font)
+		return;
 
-	if (access(font_path, F_OK) == -1 && errno == ENOENT) {
+	if (access("/res/images/font.png", F_OK) == -1 && errno == ENOENT) {
 		/* Not having a font file is normal, no need
 		 * to complain. */
 	}
-	else if (!(res = res_create_alpha_surface(font_path, NULL, &gr_font->texture))) {
+	else if (!(res = res_create_alpha_surface(font_name, font_dir, &texture))) {
 		/* The font image should be a 96x2 array of character images.
 		 * The columns are the printable ASCII characters 0x20 - 0x7f.
 		 * The top row is regular text; the bottom row is bold. */
-		gr_font->cwidth = gr_font->texture->width / 96;
-		gr_font->cheight = gr_font->texture->height / 2;
-		font_loaded = true;
+		gr_fonts[0].texture = texture;
+		gr_fonts[0].cwidth = texture->width / 96;
+		gr_fonts[0].cheight = texture->height / 2;
+		gr_fonts[0].ascii_direct = true;
+		gr_font_count = 1;
+		gr_font = &gr_fonts[0];
+		return;
 	}
 	else {
-		printf("%s: failed to read font: res=%d\n", font_path, res);
+		printf("%s/%s.png: failed to read font: res=%d\n", font_dir,
+		       font_name, res);
 	}
 
-	if (!font_loaded) {
-		uint8_t *bits, data, *in = font.rundata;
+	/* Fall back to the compiled-in atlases, they are already expanded
+	 * by mkfont at build time so there is nothing to decode here. */
+	for (i = 0; i < FONT_ATLAS_COUNT; i++) {
+		texture = &gr_font_textures[i];
+		texture->width = font_atlas[i].width;
+		texture->height = font_atlas[i].height;
+		texture->row_bytes = font_atlas[i].width;
+		texture->pixel_bytes = 1;
+		texture->data = (unsigned char *)font_atlas[i].data;
+
+		gr_fonts[i].texture = texture;
+		gr_fonts[i].cwidth = font_atlas[i].cwidth;
+		gr_fonts[i].cheight = font_atlas[i].cheight;
+		gr_fonts[i].ascii_direct = true;
+	}
+
+	gr_font_count = FONT_ATLAS_COUNT;
+	gr_font = &gr_fonts[0];
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Safe to call from any thread, the font is set up once */
+void
+gr_init_font(void)
+{
+	pthread_once(&gr_font_once, gr_font_setup);
+}
 
-		/* fall back to the compiled-in font. */
-		/* TODO: Check for error */
-		gr_font->texture = malloc(sizeof(*gr_font->texture));
-		gr_font->texture->width = font.width;
-		gr_font->texture->height = font.height;
-		gr_font->texture->row_bytes = font.width;
-		gr_font->texture->pixel_bytes = 1;
+/* ------------------------------------------------------------------------ */
 
-		/* TODO: Check for error */
-		bits = malloc(font.width * font.height);
-		gr_font->texture->data = (void *)bits;
+static void
+psf_index_add(GRFont *font, uint32_t c, int glyph)
+{
+	uint16_t **page;
+
+	if (c >= GLYPH_PAGES * GLYPH_PAGE_SIZE)
+		return; /* beyond the BMP, no console font has those */
+
+	page = &font->index[c / GLYPH_PAGE_SIZE];
+	if (!*page && !(*page = calloc(GLYPH_PAGE_SIZE, sizeof(**page)))) {
+		perror("can't allocate the glyph index");
+		return;
+	}
 
-		while ((data = *in++)) {
-			memset(bits, (data & 0x80) ? 255 : 0, data & 0x7f);
-			bits += (data & 0x7f);
+	if (!(*page)[c % GLYPH_PAGE_SIZE])
+		(*page)[c % GLYPH_PAGE_SIZE] = glyph + 1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Turn the PSF unicode table into the two-level codepoint index: only the
+ * pages of 256 codepoints used by the font are allocated and a lookup is
+ * two loads, whatever the script. The sequences are skipped. */
+static void
+psf_build_index(GRFont *font, const uint8_t *p, const uint8_t *end, bool psf2)
+{
+	int glyph = 0;
+	uint32_t c;
+
+	/* the table ends with a separator, utf8_next() can't cross it */
+	if (psf2 && (p >= end || end[-1] != 0xff))
+		return;
+
+	if (!(font->index = calloc(GLYPH_PAGES, sizeof(*font->index)))) {
+		perror("can't allocate the glyph index");
+		return;
+	}
+
+	while (p < end && glyph < font->glyph_count) {
+		if (psf2) {
+			if (*p == 0xff) {
+				glyph++, p++;
+				continue;
+			}
+			if (*p == 0xfe) {
+				while (*p != 0xff)
+					p++;
+				continue;
+			}
+			c = utf8_next(&p);
+		} else {
+			if (end - p < 2)
+				break;
+			c = p[0] | p[1] << 8;
+			p += 2;
+			if (c == 0xffff) {
+				glyph++;
+				continue;
+			}
+			if (c == 0xfffe) {
+				while (end - p >= 2 && (p[0] | p[1] << 8) != 0xffff)
+					p += 2;
+				continue;
+			}
 		}
+		psf_index_add(font, c, glyph);
+	}
+
+	font->ascii_direct = true;
+	for (c = 32; c < 127; c++)
+		if (gr_font_lookup(font, c) != (int)c)
+			font->ascii_direct = false;
+}
+
+/* ------------------------------------------------------------------------ */
 
-		gr_font->cwidth = font.cwidth;
-		gr_font->cheight = font.cheight;
+static void
+gr_font_release(GRFont *font)
+{
+	int i;
+
+	if (font->index) {
+		for (i = 0; i < GLYPH_PAGES; i++)
+			free(font->index[i]);
+		free(font->index);
+	}
+
+	if (font->map)
+		munmap(font->map, font->map_size);
+
+	memset(font, 0, sizeof(*font));
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Map a PSF1 or PSF2 console font: the glyphs are drawn straight from its
+ * 1-bpp bitmaps, nothing is decoded or copied but its unicode table. */
+static int
+psf_map(const char *path, GRFont *font)
+{
+	int fd;
+	void *map;
+	struct stat st;
+	const uint8_t *p;
+	GRFont psf = { 0 };
+	uint32_t count, charsize, offset;
+	bool has_table, psf2;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct psf2_header)) {
+		printf("%s: not a psf font\n", path);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("can't map the psf font");
+		return -1;
+	}
+
+	p = map;
+	if (p[0] == PSF1_MAGIC0 && p[1] == PSF1_MAGIC1) {
+		psf2 = false;
+		offset = 4;
+		charsize = p[3];
+		count = (p[2] & PSF1_MODE512) ? 512 : 256;
+		has_table = p[2] & (PSF1_MODEHASTAB | PSF1_MODESEQ);
+		psf.cwidth = 8;
+		psf.cheight = charsize;
+	} else if (((struct psf2_header *)map)->magic == PSF2_MAGIC) {
+		struct psf2_header *h = map;
+
+		psf2 = true;
+		offset = h->headersize;
+		charsize = h->charsize;
+		count = h->length;
+		has_table = h->flags & PSF2_HAS_UNICODE_TABLE;
+		psf.cwidth = h->width;
+		psf.cheight = h->height;
+	} else {
+		printf("%s: not a psf font\n", path);
+		goto err_unmap;
+	}
+
+	psf.glyph_row_bytes = (psf.cwidth + 7) >> 3;
+	if (!psf.cwidth || !psf.cheight || !count || count > UINT16_MAX ||
+	    charsize < (uint32_t)(psf.glyph_row_bytes * psf.cheight) ||
+	    (uint64_t)offset + (uint64_t)count * charsize > (uint64_t)st.st_size) {
+		printf("%s: corrupted psf font\n", path);
+		goto err_unmap;
+	}
+
+	psf.glyphs = p + offset;
+	psf.glyph_bytes = charsize;
+	psf.glyph_count = count;
+	psf.ascii_direct = true;
+	psf.map = map;
+	psf.map_size = st.st_size;
+
+	if (has_table)
+		psf_build_index(&psf, p + offset + count * charsize,
+				p + st.st_size, psf2);
+
+	printf("psf font %s: %u glyphs of %dx%d%s\n", path, count, psf.cwidth,
+	       psf.cheight, psf.index ? " with unicode table" : "");
+
+	*font = psf;
+	return 0;
+
+err_unmap:
+	munmap(map, st.st_size);
+	return -1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static bool
+gr_ext_font_get(void)
+{
+	if (!gr_ext_font_state)
+		gr_ext_font_state = psf_map(gr_ext_font_path, &gr_ext_font) ? -1 : 1;
+
+	return gr_ext_font_state > 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+int
+gr_load_psf_font(const char *path)
+{
+	GRFont psf;
+
+	if (psf_map(path, &psf)) {
+		perror("can't load the psf font");
+		return -1;
 	}
+
+	if (gr_fonts[0].map)
+		gr_font_release(&gr_fonts[0]);
+
+	gr_fonts[0] = psf;
+	gr_font_count = 1;
+	gr_font = &gr_fonts[0];
+	gr_layout_flush();
+	gr_text_cache_flush();
+	return 0;
 }
 
 /* ------------------------------------------------------------------------ */
@@ -494,26 +1311,101 @@ gr_init_font(void)
 GRSurface *gr_flip(void)
 {
     GRSurface *srf_ptr = gr_draw;
+    TRACE_BEGIN("gr_flip");
+    gr_stats_stamp(GR_DRAW_END);
+    if (gr_backend->damage)
+        gr_backend->damage(gr_backend, gr_damage_y1, gr_damage_y2);
+    gr_damage_y1 = gr_damage_y2 = 0;
+    gr_stats_stamp(GR_FLIP_SUBMIT);
     gr_draw = gr_backend->flip(gr_backend);
+    gr_stats_stamp(GR_FLIP_DONE);
+    gr_frames++;
+    TRACE_END("gr_flip");
     return srf_ptr;
 }
 
+/* Flip, and start the next frame from a copy of the one flipped, unless
+ * the drawing surface holds it already */
 GRSurface *gr_flip_n_copy(void)
 {
-    GRSurface *gr_flip_ptr;
+    GRSurface *gr_flip_ptr = gr_flip();
+
+    if (gr_flip_ptr && gr_draw && gr_draw != gr_flip_ptr &&
+            gr_buffer_age() != 1 &&
+            gr_draw->height == gr_flip_ptr->height &&
+            gr_draw->row_bytes == gr_flip_ptr->row_bytes)
+        memcpy(gr_draw->data, gr_flip_ptr->data,
+               gr_draw->height * gr_draw->row_bytes);
+
+    return gr_flip_ptr;
+}
+
+int
+gr_buffer_age(void)
+{
+	if (!gr_backend || !gr_backend->buffer_age)
+		return 0;
 
-    gr_save();
-    gr_flip_ptr = gr_flip();
-    gr_restore();
+	return gr_backend->buffer_age(gr_backend);
+}
 
-	return gr_flip_ptr;
+unsigned
+gr_frame_count(void)
+{
+	return gr_frames;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static const char *gr_backend_name = NULL;
+
+void
+gr_set_backend(const char *name)
+{
+	gr_backend_name = name;
+}
+
+static bool gr_inherit_screen = true;
+
+void
+gr_set_inherit(bool inherit)
+{
+	gr_inherit_screen = inherit;
+}
+
+bool
+gr_inherit(void)
+{
+	return gr_inherit_screen;
 }
 
 /* ------------------------------------------------------------------------ */
 
 int gr_init(bool blank)
 {
-	if ((gr_vt_fd = open("/dev/tty0", O_RDWR | O_SYNC)) < 0) {
+	const char *name = gr_backend_name;
+
+	if (!name)
+		name = getenv("YAMUI_BACKEND");
+	if (name && !*name)
+		name = NULL;
+
+	if (name && strcmp(name, "mem") && strcmp(name, "drm") &&
+	    strcmp(name, "fbdev")) {
+		fprintf(stderr, "unknown graphics backend \"%s\"\n", name);
+		return -1;
+	}
+
+	/* Headless, there is no console to switch to graphics */
+	if (name && !strcmp(name, "mem")) {
+		gr_backend = open_mem();
+		goto backend_init;
+	}
+
+	/* Only KDSETMODE is needed: no O_SYNC and no blocking on a busy tty,
+	 * the display path shouldn't wait for the console. */
+	if ((gr_vt_fd = open("/dev/tty0",
+			     O_RDWR | O_NONBLOCK | O_NOCTTY | O_CLOEXEC)) < 0) {
 		/* This is non-fatal; post-Cupcake kernels don't have tty0. */
 		perror("can't open /dev/tty0");
 	} else if (ioctl(gr_vt_fd, KDSETMODE, (void *)KD_GRAPHICS)) {
@@ -528,24 +1420,22 @@ int gr_init(bool blank)
 	    gr_backend = open_adf();
 #endif
 
-	if(!gr_backend)
+	if(!gr_backend && (!name || !strcmp(name, "drm")))
 	    gr_backend = open_drm();
-	if(!gr_backend)
+	if(!gr_backend && (!name || !strcmp(name, "fbdev")))
 	    gr_backend = open_fbdev();
 	if(!gr_backend)
         goto err_quit;
 
-    m_gettimems = -1;
-	get_ms_time_run();
-	
+backend_init:
+	TRACE_BEGIN("gr_init backend");
 	gr_draw = gr_backend->init(gr_backend, blank);
+	TRACE_END("gr_init backend");
 	if (!gr_draw) {
 		gr_backend->exit(gr_backend);
         goto err_quit;
 	}
 
-	get_ms_time_run();
-
 #if 0
 	gr_flip();
 	if (!gr_draw)
@@ -556,8 +1446,6 @@ int gr_init(bool blank)
 	get_ms_time_run();
 #endif
 
-	gr_init_font();
-
     if(overscan_percent) {
 	    overscan_offset_x = INT_DIV(gr_draw->width  * overscan_percent, 100);
 	    overscan_offset_y = INT_DIV(gr_draw->height * overscan_percent, 100);
@@ -614,6 +1502,9 @@ gr_fb_blank(bool blank)
 void
 gr_save(void)
 {
+	/* what was drawn since the flip is not on screen, to leave it out */
+	if (gr_backend->damage && gr_damage_y1 < gr_damage_y2)
+		gr_backend->damage(gr_backend, gr_damage_y1, gr_damage_y2);
 	if (gr_backend->save)
 		gr_backend->save(gr_backend);
 }
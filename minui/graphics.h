@@ -53,11 +53,59 @@ typedef struct minui_backend {
 
 	/* Restore screen content from internal buffer. */
 	void (*restore)(struct minui_backend *backend);
+
+	/* Number of flips since the drawing surface was last displayed: 1
+	 * when it holds the frame just flipped, 0 when its content is
+	 * unknown. Optional, a NULL hook is the same as always 0. */
+	int (*buffer_age)(struct minui_backend *backend);
+
+	/* Called right before flip() with the rows y1 to y2 - 1 of the
+	 * drawing surface drawn since the last flip, none if y1 >= y2, and
+	 * before save() if there are any. Optional, the backends that copy
+	 * the frame can copy only those. */
+	void (*damage)(struct minui_backend *backend, int y1, int y2);
 } minui_backend;
 
+/* Text primitives shared with the layout code. */
+
+/* Top-left corner of a text block of width x height at (kx, ky) thousandths
+ * of the screen, the same placement gr_text() uses for its row. */
+void gr_text_origin(int kx, int ky, int width, int height, int row,
+		    int *x, int *y);
+
+/* Advance in pixels of the next character of *s, moving *s past it. */
+int  gr_glyph_advance(const char **s, int factor);
+
+/* Height in pixels of a text line. */
+int  gr_font_height(int factor);
+
+/* Draw len bytes of s with their top-left corner at (x, y) pixels. */
+void gr_text_run(int x, int y, const char *s, int len, int bold, int factor);
+
+/* Drop the cached layouts, their measures are stale once the font changes. */
+void gr_layout_flush(void);
+
+/* Drop the rendered text runs, the next draws expand their glyphs again. */
+void gr_text_cache_flush(void);
+
+/* Frame timing stamps, taken by graphics.c for minui/stats.c */
+typedef enum {
+	GR_DRAW_START,		/* the first primitive drawn since the flip */
+	GR_DRAW_END,		/* gr_flip() called */
+	GR_FLIP_SUBMIT,		/* the backend flip called */
+	GR_FLIP_DONE,		/* the backend flip returned */
+	GR_STAMP_COUNT,
+} gr_stamp;
+
+void gr_stats_stamp(gr_stamp stamp);
+
+/* Set by gr_set_inherit(), for the backends to read on init. */
+bool gr_inherit(void);
+
 minui_backend *open_fbdev(void);
 minui_backend *open_adf(void);
 minui_backend *open_drm(void);
+minui_backend *open_mem(void);
 
 #ifdef __cplusplus
 }
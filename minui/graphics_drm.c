@@ -15,15 +15,19 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <dirent.h>
 #include <drm_fourcc.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/cdefs.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <xf86drm.h>
@@ -38,20 +42,59 @@
 #endif
 #define RECOVERY_RGBX 1
 
-#define MSTIME_HEADER_ONLY
-#define MSTIME_STATIC_VARS
-#include "../get_time_ms.c"
+/* Set YAMUI_DRM_MIRROR=1 in the environment to light up all the connected
+ * displays, not only the main one, with the same content. */
+#define DRM_MIRROR_ENV "YAMUI_DRM_MIRROR"
+#define DRM_MAX_MIRRORS 3
+
+/* With a third buffer there is always one to draw into while the last
+ * one flipped waits for the vblank, so drawing doesn't stall on it. */
+#ifndef DRM_NUM_BUFFERS
+#define DRM_NUM_BUFFERS 3
+#endif
+
+#ifndef DRM_HINT_FILE
+#define DRM_HINT_FILE "/run/yamui/drm-hint"
+#endif
+
+#include "../trace.h"
 
 struct drm_surface {
     GRSurface base;
     uint32_t fb_id;
     uint32_t handle;
+    unsigned char *map;
+    size_t map_size;
+    uint64_t frame;     /* the last frame flipped from it, 0 if none */
+};
+
+/* A display that shows the same framebuffer as the main one, its CRTC
+ * scans out the mode at x, y of the framebuffer. */
+struct drm_mirror {
+    uint32_t crtc_id;
+    uint32_t connector_id;
+    drmModeModeInfo mode;
+    uint32_t x;
+    uint32_t y;
 };
 
-static struct drm_surface *drm_surfaces[2];
+static struct drm_surface *drm_surfaces[DRM_NUM_BUFFERS];
 static int current_buffer;
+static int front_buffer = -1;
+static int pending_buffer = -1;
+static int flip_pending = 0;
+static uint64_t drm_frames = 0;
+static int drm_fb_width, drm_fb_height;
+/* The screen put aside by save, restore scans it out again */
+static struct drm_surface *drm_saved = NULL;
+static bool saved_on_screen = false;
+static bool drm_blanked = false;
 static drmModeCrtc *main_monitor_crtc;
 static drmModeConnector * __restrict main_monitor_connector = NULL;
+static uint32_t main_monitor_connector_id;
+static uint32_t main_monitor_x, main_monitor_y;
+static struct drm_mirror mirrors[DRM_MAX_MIRRORS];
+static int num_mirrors = 0;
 static int drm_fd = -1;
 
 static void drm_disable_crtc(int drm_fd, drmModeCrtc *crtc) {
@@ -70,22 +113,130 @@ static void drm_enable_crtc(int drm_fd, drmModeCrtc *crtc,
     int32_t ret;
     ret = drmModeSetCrtc(drm_fd, crtc->crtc_id,
                          surface->fb_id,
-                         0, 0,
-                         &main_monitor_connector->connector_id,
+                         main_monitor_x, main_monitor_y,
+                         &main_monitor_connector_id,
                          1,
                          &main_monitor_crtc->mode);
     if (ret)
         printf("drmModeSetCrtc failed ret=%d\n", ret);
 }
 
+static void drm_disable_mirrors(int drm_fd) {
+    int i;
+    for (i = 0; i < num_mirrors; i++)
+        drmModeSetCrtc(drm_fd, mirrors[i].crtc_id, 0, 0, 0, NULL, 0, NULL);
+}
+
+static void drm_enable_mirrors(int drm_fd, struct drm_surface *surface) {
+    int32_t ret;
+    int i;
+    for (i = 0; i < num_mirrors; i++) {
+        ret = drmModeSetCrtc(drm_fd, mirrors[i].crtc_id, surface->fb_id,
+                             mirrors[i].x, mirrors[i].y,
+                             &mirrors[i].connector_id, 1, &mirrors[i].mode);
+        if (ret)
+            printf("drmModeSetCrtc failed on mirror %d ret=%d\n", i, ret);
+    }
+}
+
+static void page_flip_handler(int fd __unused, unsigned int sequence __unused,
+                              unsigned int tv_sec __unused,
+                              unsigned int tv_usec __unused, void *data) {
+    (void)fd;
+    (void)sequence;
+    (void)tv_sec;
+    (void)tv_usec;
+
+    if (*(int *)data > 0)
+        (*(int *)data)--;
+}
+
+/* Wait for the page flips requested with DRM_MODE_PAGE_FLIP_EVENT, if any,
+ * no longer than a few frames in case an event is lost. Then the pending
+ * buffer is the one on screen. */
+static void drm_wait_flip(void) {
+    drmEventContext evctx = {
+        .version = DRM_EVENT_CONTEXT_VERSION,
+        .page_flip_handler = page_flip_handler,
+    };
+    struct pollfd pfd = { .fd = drm_fd, .events = POLLIN };
+
+    while (flip_pending > 0) {
+        if (poll(&pfd, 1, 100) <= 0) {
+            flip_pending = 0;
+            break;
+        }
+        drmHandleEvent(drm_fd, &evctx);
+    }
+
+    if (pending_buffer >= 0) {
+        front_buffer = pending_buffer;
+        pending_buffer = -1;
+        saved_on_screen = false;
+    }
+}
+
+/* The buffer on screen, once the pending flip is over */
+static struct drm_surface *drm_front_surface(void) {
+    if (saved_on_screen)
+        return drm_saved;
+    return front_buffer >= 0 ? drm_surfaces[front_buffer] : NULL;
+}
+
+/* The next buffer to draw into: neither on screen nor waiting to be. */
+static int drm_next_buffer(void) {
+    int i, n;
+
+    for (i = 1; i < DRM_NUM_BUFFERS; i++) {
+        n = (current_buffer + i) % DRM_NUM_BUFFERS;
+        if (n != front_buffer && n != pending_buffer)
+            return n;
+    }
+
+    return -1;
+}
+
+/* The modes are the same if their timings are, the type and the name
+ * that follow them don't matter. */
+static bool drm_same_mode(const drmModeModeInfo *a,
+                          const drmModeModeInfo *b) {
+    return !memcmp(a, b, offsetof(drmModeModeInfo, type));
+}
+
+/* Whether the CRTC is already lit with the mode and feeds the connector,
+ * as the bootloader or the kernel console usually leaves it. */
+static bool drm_crtc_has_mode(int fd, drmModeCrtc *crtc,
+                              drmModeConnector *connector,
+                              drmModeModeInfo *mode) {
+    drmModeEncoder *encoder;
+    bool ret;
+
+    if (!crtc->mode_valid || !crtc->buffer_id ||
+            !drm_same_mode(&crtc->mode, mode) || !connector->encoder_id)
+        return false;
+
+    encoder = drmModeGetEncoder(fd, connector->encoder_id);
+    if (!encoder)
+        return false;
+    ret = (encoder->crtc_id == crtc->crtc_id);
+    drmModeFreeEncoder(encoder);
+
+    return ret;
+}
+
 static void drm_blank(minui_backend* backend __unused, bool blank) {
     (void)backend;
 
-    if (blank)
+    drm_wait_flip();
+    if (blank) {
         drm_disable_crtc(drm_fd, main_monitor_crtc);
-    else
-        drm_enable_crtc(drm_fd, main_monitor_crtc,
-                        drm_surfaces[current_buffer]);
+        drm_disable_mirrors(drm_fd);
+        drm_blanked = true;
+    } else if (drm_front_surface()) {
+        drm_enable_crtc(drm_fd, main_monitor_crtc, drm_front_surface());
+        drm_enable_mirrors(drm_fd, drm_front_surface());
+        drm_blanked = false;
+    }
 }
 
 static void drm_destroy_surface(struct drm_surface *surface) {
@@ -93,9 +244,8 @@ static void drm_destroy_surface(struct drm_surface *surface) {
     int ret;
     if(!surface)
         return;
-    if (surface->base.data)
-        munmap(surface->base.data,
-               surface->base.row_bytes * surface->base.height);
+    if (surface->map)
+        munmap(surface->map, surface->map_size);
     if (surface->fb_id) {
         ret = drmModeRmFB(drm_fd, surface->fb_id);
         if (ret)
@@ -128,6 +278,18 @@ static int drm_format_to_bpp(uint32_t format) {
     }
 }
 
+static uint32_t drm_surface_format(void) {
+#if defined(RECOVERY_ABGR)
+    return DRM_FORMAT_RGBA8888;
+#elif defined(RECOVERY_BGRA)
+    return DRM_FORMAT_ARGB8888;
+#elif defined(RECOVERY_RGBX)
+    return DRM_FORMAT_XBGR8888;
+#else
+    return DRM_FORMAT_RGB565;
+#endif
+}
+
 static struct drm_surface *drm_create_surface(int width, int height) {
     struct drm_surface *surface;
     struct drm_mode_create_dumb create_dumb;
@@ -138,15 +300,7 @@ static struct drm_surface *drm_create_surface(int width, int height) {
         printf("Can't allocate memory\n");
         return NULL;
     }
-#if defined(RECOVERY_ABGR)
-    format = DRM_FORMAT_RGBA8888;
-#elif defined(RECOVERY_BGRA)
-    format = DRM_FORMAT_ARGB8888;
-#elif defined(RECOVERY_RGBX)
-    format = DRM_FORMAT_XBGR8888;
-#else
-    format = DRM_FORMAT_RGB565;
-#endif
+    format = drm_surface_format();
     memset(&create_dumb, 0, sizeof(create_dumb));
     create_dumb.height = height;
     create_dumb.width = width;
@@ -195,12 +349,143 @@ static struct drm_surface *drm_create_surface(int width, int height) {
                               drm_fd, map_dumb.offset);
     if (surface->base.data == MAP_FAILED) {
         perror("mmap() failed");
+        surface->base.data = NULL;
         drm_destroy_surface(surface);
         return NULL;
     }
+    surface->map = surface->base.data;
+    surface->map_size = surface->base.height * surface->base.row_bytes;
     return surface;
 }
 
+/* Restrict the drawing to the width x height rectangle at x, y of the
+ * framebuffer, the rest of it is only scanned out by the mirrors. */
+static void drm_surface_view(struct drm_surface *surface, int x, int y,
+                             int width, int height) {
+    surface->base.data = surface->map + y * surface->base.row_bytes +
+                         x * surface->base.pixel_bytes;
+    surface->base.width = width;
+    surface->base.height = height;
+}
+
+/* The 32 bpp formats differ only in the order of the bytes. */
+static bool drm_format_swaps_rb(uint32_t src, uint32_t dst) {
+    bool src_bgr = (src == DRM_FORMAT_XRGB8888 || src == DRM_FORMAT_ARGB8888);
+    bool dst_bgr = (dst == DRM_FORMAT_XRGB8888 || dst == DRM_FORMAT_ARGB8888);
+    return src_bgr != dst_bgr;
+}
+
+static bool drm_format_is_rgb32(uint32_t format) {
+    return format == DRM_FORMAT_XRGB8888 || format == DRM_FORMAT_ARGB8888 ||
+           format == DRM_FORMAT_XBGR8888 || format == DRM_FORMAT_ABGR8888;
+}
+
+/*
+ * Copy what the CRTC is scanning out, usually the bootloader splash, into
+ * the surfaces: the content of the screen survives the handoff and can be
+ * drawn over instead of being redrawn. The framebuffer is read through its
+ * GEM handle, that only the DRM master gets, mapped as a dumb buffer; the
+ * 32 bpp RGB and BGR formats can be copied, anything else is left alone.
+ * Each row is read once from the uncached mapping and written to all the
+ * surfaces from a cached copy. The copy starts at (crtc_x, crtc_y), where
+ * the CRTC scans the framebuffer out from.
+ */
+static bool drm_inherit_fb(int fd, uint32_t fb_id, uint32_t crtc_x,
+                           uint32_t crtc_y, struct drm_surface **surfaces,
+                           int count) {
+    struct drm_mode_map_dumb map_dumb;
+    struct drm_gem_close gem_close;
+    drmModeFB2 *fb2;
+    drmModeFB *fb;
+    uint32_t handles[4] = { 0, 0, 0, 0 };
+    uint32_t format, handle, pitch, offset, width, height, x, y;
+    uint8_t *map, *row = NULL;
+    size_t size;
+    bool swap, ret = false;
+    int i, j;
+
+    if ((fb2 = drmModeGetFB2(fd, fb_id))) {
+        format = fb2->pixel_format;
+        /* each plane may have its handle, all of them are ours to close */
+        memcpy(handles, fb2->handles, sizeof(handles));
+        handle = fb2->handles[0];
+        pitch = fb2->pitches[0];
+        offset = fb2->offsets[0];
+        width = fb2->width;
+        height = fb2->height;
+        drmModeFreeFB2(fb2);
+    } else if ((fb = drmModeGetFB(fd, fb_id))) {
+        /* the legacy call has no format, 24/32 is XRGB8888 */
+        format = (fb->bpp == 32 && fb->depth == 24) ? DRM_FORMAT_XRGB8888 : 0;
+        handle = handles[0] = fb->handle;
+        pitch = fb->pitch;
+        offset = 0;
+        width = fb->width;
+        height = fb->height;
+        drmModeFreeFB(fb);
+    } else {
+        return false;
+    }
+
+    if (!handle)
+        goto close_handle;
+    if (!drm_format_is_rgb32(format) || crtc_x >= width || crtc_y >= height)
+        goto close_handle;
+
+    memset(&map_dumb, 0, sizeof(map_dumb));
+    map_dumb.handle = handle;
+    if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb))
+        goto close_handle;
+
+    size = (size_t)pitch * height + offset;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, map_dumb.offset);
+    if (map == MAP_FAILED)
+        goto close_handle;
+
+    offset += crtc_y * pitch + (crtc_x << 2);
+    width -= crtc_x;
+    height -= crtc_y;
+    if (width > (uint32_t)surfaces[0]->base.width)
+        width = surfaces[0]->base.width;
+    if (height > (uint32_t)surfaces[0]->base.height)
+        height = surfaces[0]->base.height;
+    swap = drm_format_swaps_rb(format, drm_surface_format());
+
+    if (!(row = malloc(width << 2)))
+        goto unmap;
+
+    for (y = 0; y < height; y++) {
+        memcpy(row, map + offset + y * pitch, width << 2);
+        if (swap)
+            for (x = 0; x < width << 2; x += 4) {
+                uint8_t t = row[x];
+                row[x] = row[x + 2];
+                row[x + 2] = t;
+            }
+        for (i = 0; i < count; i++)
+            memcpy(surfaces[i]->base.data + y * surfaces[i]->base.row_bytes,
+                   row, width << 2);
+    }
+    ret = true;
+
+    free(row);
+unmap:
+    munmap(map, size);
+close_handle:
+    for (i = 0; i < 4; i++) {
+        if (!handles[i])
+            continue;
+        for (j = 0; j < i && handles[j] != handles[i]; j++)
+            ;
+        if (j < i)
+            continue;
+        memset(&gem_close, 0, sizeof(gem_close));
+        gem_close.handle = handles[i];
+        drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+    }
+    return ret;
+}
+
 static drmModeCrtc *find_crtc_for_connector(int fd,
                             drmModeRes *resources,
                             drmModeConnector *connector) {
@@ -241,45 +526,92 @@ static drmModeCrtc *find_crtc_for_connector(int fd,
     return NULL;
 }
 
-static drmModeConnector *find_used_connector_by_type(int fd,
-                                 drmModeRes *resources,
-                                 unsigned type) {
+/*
+ * Every connector of the device is fetched once and the list is shared by
+ * all the lookups below. The connectors are read with the non-probing
+ * drmModeGetConnectorCurrent(), that returns what the kernel already knows,
+ * and only if none of them turns out to be connected they are read again
+ * with drmModeGetConnector(), whose probe can read the EDIDs for hundreds
+ * of milliseconds.
+ */
+struct drm_connectors {
+    int count;
+    drmModeConnector **list;
+};
+
+static void drm_free_connectors(struct drm_connectors *conns) {
     int i;
-    for (i = 0; i < resources->count_connectors; i++) {
-        drmModeConnector *connector;
-        connector = drmModeGetConnector(fd, resources->connectors[i]);
-        if (connector) {
-            if ((connector->connector_type == type) &&
-                    (connector->connection == DRM_MODE_CONNECTED) &&
-                    (connector->count_modes > 0))
-                return connector;
-            drmModeFreeConnector(connector);
-        }
-    }
-    return NULL;
+    for (i = 0; i < conns->count; i++)
+        if (conns->list[i])
+            drmModeFreeConnector(conns->list[i]);
+    free(conns->list);
+    conns->list = NULL;
+    conns->count = 0;
+}
+
+static bool connector_is_used(const drmModeConnector *connector) {
+    return connector && (connector->connection == DRM_MODE_CONNECTED) &&
+           (connector->count_modes > 0);
+}
+
+static int find_used_connector_by_type(const struct drm_connectors *conns,
+                                       unsigned type) {
+    int i;
+    for (i = 0; i < conns->count; i++)
+        if (connector_is_used(conns->list[i]) &&
+                conns->list[i]->connector_type == type)
+            return i;
+    return -1;
 }
 
-static drmModeConnector *find_first_connected_connector(int fd,
-                             drmModeRes *resources) {
+static int find_first_connected_connector(const struct drm_connectors *conns) {
     int i;
-    for (i = 0; i < resources->count_connectors; i++) {
-        drmModeConnector *connector;
-        connector = drmModeGetConnector(fd, resources->connectors[i]);
-        if (connector) {
-            if ((connector->count_modes > 0) &&
-                    (connector->connection == DRM_MODE_CONNECTED))
-                return connector;
-            drmModeFreeConnector(connector);
+    for (i = 0; i < conns->count; i++)
+        if (connector_is_used(conns->list[i]))
+            return i;
+    return -1;
+}
+
+static int drm_get_connectors(int fd, drmModeRes *resources,
+                              struct drm_connectors *conns) {
+    int i, probe;
+
+    conns->list = calloc(resources->count_connectors, sizeof(*conns->list));
+    if (!conns->list) {
+        printf("Can't allocate memory\n");
+        return -1;
+    }
+    conns->count = resources->count_connectors;
+
+    for (probe = 0; probe < 2; probe++) {
+        for (i = 0; i < conns->count; i++) {
+            if (conns->list[i])
+                drmModeFreeConnector(conns->list[i]);
+            conns->list[i] = probe ?
+                drmModeGetConnector(fd, resources->connectors[i]) :
+                drmModeGetConnectorCurrent(fd, resources->connectors[i]);
         }
+        if (find_first_connected_connector(conns) >= 0)
+            break;
     }
-    return NULL;
+
+    return 0;
 }
 
+static uint32_t find_preferred_mode(const drmModeConnector *connector) {
+    int modes;
+    for (modes = 0; modes < connector->count_modes; modes++)
+        if (connector->modes[modes].type & DRM_MODE_TYPE_PREFERRED)
+            return modes;
+    return 0;
+}
+
+/* Takes the main monitor connector out of the list, the caller owns it. */
 static drmModeConnector *
-find_main_monitor(int fd, drmModeRes *resources, uint32_t *mode_index)
+find_main_monitor(struct drm_connectors *conns, uint32_t *mode_index)
 {
     unsigned i = 0;
-    int modes;
+    int found;
 
     /* Look for LVDS/eDP/DSI connectors. Those are the main screens. */
     unsigned kConnectorPriority[] = {
@@ -290,96 +622,351 @@ find_main_monitor(int fd, drmModeRes *resources, uint32_t *mode_index)
     drmModeConnector *main_monitor_connector = NULL;
 
     do {
-        main_monitor_connector = find_used_connector_by_type(fd,
-                                         resources,
-                                         kConnectorPriority[i]);
+        found = find_used_connector_by_type(conns, kConnectorPriority[i]);
         i++;
-    } while (!main_monitor_connector && i < ARRAY_SIZE(kConnectorPriority));
+    } while (found < 0 && i < ARRAY_SIZE(kConnectorPriority));
 
     /* If we didn't find a connector, grab the first one that is connected. */
-    if (!main_monitor_connector)
-        main_monitor_connector =
-                find_first_connected_connector(fd, resources);
+    if (found < 0)
+        found = find_first_connected_connector(conns);
 
     /* If we still didn't find a connector, give up and return. */
-    if (!main_monitor_connector)
+    if (found < 0)
         return NULL;
 
-    *mode_index = 0;
-    for (modes = 0; modes < main_monitor_connector->count_modes; modes++) {
-        if (main_monitor_connector->modes[modes].type &
-                DRM_MODE_TYPE_PREFERRED) {
-            *mode_index = modes;
-            break;
-        }
-    }
+    main_monitor_connector = conns->list[found];
+    conns->list[found] = NULL;
 
+    *mode_index = find_preferred_mode(main_monitor_connector);
     return main_monitor_connector;
 }
 
+static bool drm_crtc_is_mirror(uint32_t crtc_id) {
+    int i;
+    for (i = 0; i < num_mirrors; i++)
+        if (mirrors[i].crtc_id == crtc_id)
+            return true;
+    return false;
+}
+
+/* All the CRTCs but the main one and the mirrors are turned off, walking
+ * the CRTCs needs no connector at all. */
 static void disable_non_main_crtcs(int fd,
                     drmModeRes *resources,
                     drmModeCrtc* main_crtc) {
     int i;
     drmModeCrtc* crtc;
-    for (i = 0; i < resources->count_connectors; i++) {
-        drmModeConnector *connector;
-        connector = drmModeGetConnector(fd, resources->connectors[i]);
-        crtc = find_crtc_for_connector(fd, resources, connector);
-        if (crtc->crtc_id != main_crtc->crtc_id)
+    for (i = 0; i < resources->count_crtcs; i++) {
+        if (resources->crtcs[i] == main_crtc->crtc_id ||
+                drm_crtc_is_mirror(resources->crtcs[i]))
+            continue;
+        crtc = drmModeGetCrtc(fd, resources->crtcs[i]);
+        if (crtc && crtc->mode_valid)
             drm_disable_crtc(fd, crtc);
         drmModeFreeCrtc(crtc);
     }
 }
 
-static GRSurface* drm_init(minui_backend* backend __unused, bool blank) {
-    (void)backend;
-    (void)blank;
+/* A CRTC that can drive the connector and is not in the used mask, the one
+ * already feeding it if possible. Returns its index or -1. */
+static int drm_pick_crtc(int fd, drmModeRes *resources,
+                         drmModeConnector *connector, uint32_t used) {
+    drmModeEncoder *encoder;
+    uint32_t possible = 0;
+    int i, j;
 
-    drmModeRes * __restrict res = NULL;
+    for (i = 0; i < connector->count_encoders; i++) {
+        encoder = drmModeGetEncoder(fd, connector->encoders[i]);
+        if (!encoder)
+            continue;
+        for (j = 0; j < resources->count_crtcs; j++)
+            if (encoder->crtc_id == resources->crtcs[j] &&
+                    encoder->encoder_id == connector->encoder_id &&
+                    !(used & (1 << j))) {
+                drmModeFreeEncoder(encoder);
+                return j;
+            }
+        possible |= encoder->possible_crtcs;
+        drmModeFreeEncoder(encoder);
+    }
 
-    uint32_t selected_mode;
-    char *dev_name;
-    int width, height;
-    int minor, ret;
+    for (j = 0; j < resources->count_crtcs; j++)
+        if ((possible & (1 << j)) && !(used & (1 << j)))
+            return j;
+    return -1;
+}
 
+/* Every other connected display gets a CRTC of its own and its preferred
+ * mode, they all scan out the main framebuffer. */
+static void drm_setup_mirrors(int fd, drmModeRes *resources,
+                              struct drm_connectors *conns) {
+    drmModeConnector *connector;
+    struct drm_mirror *mirror;
+    uint32_t used = 0;
+    int i, crtc;
 
-    /* Consider DRM devices in order. */
-    for (int_fast32_t i = 0; i < DRM_MAX_MINOR; i++) {
-        uint64_t cap = 0;
-        ret = asprintf(&dev_name, DRM_DEV_NAME, DRM_DIR_NAME, i);
-        if (ret < 0)
-            continue;
-        drm_fd = open(dev_name, O_RDWR, 0);
-        free(dev_name);
-        if (drm_fd < 0)
+    for (i = 0; i < resources->count_crtcs; i++)
+        if (resources->crtcs[i] == main_monitor_crtc->crtc_id)
+            used |= 1 << i;
+
+    num_mirrors = 0;
+    for (i = 0; i < conns->count && num_mirrors < DRM_MAX_MIRRORS; i++) {
+        connector = conns->list[i];
+        if (!connector_is_used(connector))
             continue;
-        /* We need dumb buffers. */
-        ret = drmGetCap(drm_fd, DRM_CAP_DUMB_BUFFER, &cap);
-        if (ret || cap == 0) {
-            close(drm_fd);
+        crtc = drm_pick_crtc(fd, resources, connector, used);
+        if (crtc < 0) {
+            printf("no crtc left to mirror on connector %u\n",
+                   connector->connector_id);
             continue;
         }
-        res = drmModeGetResources(drm_fd);
-        if (!res) {
-            close(drm_fd);
-            continue;
+        used |= 1 << crtc;
+
+        mirror = &mirrors[num_mirrors++];
+        mirror->crtc_id = resources->crtcs[crtc];
+        mirror->connector_id = connector->connector_id;
+        mirror->mode = connector->modes[find_preferred_mode(connector)];
+    }
+}
+
+/* Open a card that can be used: it has dumb buffers, CRTCs and connectors. */
+static int drm_open_card(int minor, drmModeRes **resources) {
+    uint64_t cap = 0;
+    char *dev_name;
+    int fd, ret;
+
+    ret = asprintf(&dev_name, DRM_DEV_NAME, DRM_DIR_NAME, minor);
+    if (ret < 0)
+        return -1;
+    fd = open(dev_name, O_RDWR | O_CLOEXEC, 0);
+    free(dev_name);
+    if (fd < 0)
+        return -1;
+
+    /* We need dumb buffers. */
+    ret = drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &cap);
+    if (ret || cap == 0)
+        goto err_close;
+
+    *resources = drmModeGetResources(fd);
+    if (!*resources)
+        goto err_close;
+    if ((*resources)->count_crtcs > 0 && (*resources)->count_connectors > 0)
+        return fd;
+
+    drmModeFreeResources(*resources);
+    *resources = NULL;
+err_close:
+    close(fd);
+    return -1;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * The cards that exist are listed by sysfs, so there is no need to try
+ * to open all the DRM_MAX_MINOR device nodes. Returns how many minors are
+ * in the list, in ascending order, or -1 if sysfs can't tell.
+ */
+static int drm_card_minors(int *minors, int max) {
+    struct dirent *de;
+    int count = 0, minor, len;
+    DIR *dir;
+
+    dir = opendir("/sys/class/drm");
+    if (!dir)
+        return -1;
+    while ((de = readdir(dir)) && count < max) {
+        /* card0 is a card, card0-HDMI-A-1 is one of its connectors */
+        if (sscanf(de->d_name, "card%d%n", &minor, &len) == 1 &&
+                !de->d_name[len])
+            minors[count++] = minor;
+    }
+    closedir(dir);
+
+    qsort(minors, count, sizeof(*minors), cmp_int);
+    return count;
+}
+
+/*
+ * The topology hint is what the last run has chosen: card, connector,
+ * CRTC and mode. It is used only if the connector is still connected
+ * with that mode and the CRTC can still drive it, else the devices are
+ * scanned as usual. DRM_HINT_FILE is on a tmpfs, the hint lasts until the
+ * next boot; define it empty to disable the hint.
+ */
+struct drm_hint {
+    int minor;
+    uint32_t connector_id;
+    uint32_t crtc_id;
+    uint32_t clock;
+    uint32_t hdisplay;
+    uint32_t vdisplay;
+    uint32_t vrefresh;
+};
+
+static int drm_read_hint(struct drm_hint *hint) {
+    FILE *fp;
+    int ret;
+
+    if (!DRM_HINT_FILE[0] || !(fp = fopen(DRM_HINT_FILE, "r")))
+        return -1;
+    ret = fscanf(fp, "%d %u %u %u %u %u %u", &hint->minor,
+                 &hint->connector_id, &hint->crtc_id, &hint->clock,
+                 &hint->hdisplay, &hint->vdisplay, &hint->vrefresh);
+    fclose(fp);
+
+    return (ret == 7) ? 0 : -1;
+}
+
+static void drm_write_hint(const struct drm_hint *hint) {
+    char dir[] = DRM_HINT_FILE;
+    char *slash = strrchr(dir, '/');
+    FILE *fp;
+
+    if (!dir[0])
+        return;
+    if (slash && slash != dir) {
+        *slash = '\0';
+        mkdir(dir, 0755);
+    }
+    if (!(fp = fopen(DRM_HINT_FILE, "w")))
+        return;
+    fprintf(fp, "%d %u %u %u %u %u %u\n", hint->minor, hint->connector_id,
+            hint->crtc_id, hint->clock, hint->hdisplay, hint->vdisplay,
+            hint->vrefresh);
+    fclose(fp);
+}
+
+static bool crtc_drives_connector(int fd, drmModeRes *resources,
+                                  drmModeConnector *connector,
+                                  uint32_t crtc_id) {
+    drmModeEncoder *encoder;
+    int i, j;
+    bool ok = false;
+
+    for (j = 0; j < resources->count_crtcs; j++)
+        if (resources->crtcs[j] == crtc_id)
+            break;
+    if (j == resources->count_crtcs)
+        return false;
+
+    for (i = 0; i < connector->count_encoders && !ok; i++) {
+        encoder = drmModeGetEncoder(fd, connector->encoders[i]);
+        if (encoder) {
+            ok = encoder->possible_crtcs & (1 << j);
+            drmModeFreeEncoder(encoder);
         }
+    }
+    return ok;
+}
 
-        minor = i;
-        /* Use this device if it has at least one connected monitor. */
-        if (res->count_crtcs > 0 && res->count_connectors > 0)
-            if (find_first_connected_connector(drm_fd, res))
-                break;
+/* Validate the hint against the device, it costs one connector and no
+ * probe. On success the card is open and the monitor is set. */
+static int drm_use_hint(const struct drm_hint *hint, drmModeRes **resources,
+                        uint32_t *mode_index) {
+    drmModeConnector *connector = NULL;
+    int i;
 
-        drmModeFreeResources(res);
-        res = NULL;
+    drm_fd = drm_open_card(hint->minor, resources);
+    if (drm_fd < 0)
+        return -1;
+
+    for (i = 0; i < (*resources)->count_connectors; i++)
+        if ((*resources)->connectors[i] == hint->connector_id)
+            connector = drmModeGetConnectorCurrent(drm_fd,
+                                                   hint->connector_id);
+    if (!connector_is_used(connector))
+        goto err_free;
+
+    for (i = 0; i < connector->count_modes; i++) {
+        drmModeModeInfo *mode = &connector->modes[i];
+        if (mode->clock == hint->clock && mode->hdisplay == hint->hdisplay &&
+                mode->vdisplay == hint->vdisplay &&
+                mode->vrefresh == hint->vrefresh)
+            break;
+    }
+    if (i == connector->count_modes ||
+            !crtc_drives_connector(drm_fd, *resources, connector,
+                                   hint->crtc_id))
+        goto err_free;
+
+    main_monitor_crtc = drmModeGetCrtc(drm_fd, hint->crtc_id);
+    if (!main_monitor_crtc)
+        goto err_free;
+
+    main_monitor_connector = connector;
+    *mode_index = i;
+    return 0;
+
+err_free:
+    if (connector)
+        drmModeFreeConnector(connector);
+    drmModeFreeResources(*resources);
+    *resources = NULL;
+    close(drm_fd);
+    drm_fd = -1;
+    return -1;
+}
+
+/* Use the first card with at least one connected monitor. */
+static int drm_scan_cards(drmModeRes **resources,
+                          struct drm_connectors *conns) {
+    int minors[DRM_MAX_MINOR], count, i;
+
+    count = drm_card_minors(minors, DRM_MAX_MINOR);
+    if (count < 0)
+        for (count = 0; count < DRM_MAX_MINOR; count++)
+            minors[count] = count;
+
+    for (i = 0; i < count; i++) {
+        drm_fd = drm_open_card(minors[i], resources);
+        if (drm_fd < 0)
+            continue;
+
+        if (!drm_get_connectors(drm_fd, *resources, conns) &&
+                find_first_connected_connector(conns) >= 0)
+            return minors[i];
+
+        drm_free_connectors(conns);
+        drmModeFreeResources(*resources);
+        *resources = NULL;
         close(drm_fd);
         drm_fd = -1;
     }
-    if (drm_fd < 0 || res == NULL) {
-        perror("cannot find/open a drm device");
-        goto exit_with_error;
+
+    return -1;
+}
+
+static GRSurface* drm_init(minui_backend* backend __unused, bool blank) {
+    (void)backend;
+
+    drmModeRes *res = NULL;
+    struct drm_connectors conns = { 0, NULL };
+    struct drm_hint hint;
+
+    uint32_t selected_mode = 0;
+    int width, height, fb_width, fb_height, i;
+    int minor;
+    bool hinted, takeover, inherited = false, mirror;
+    const char *env = getenv(DRM_MIRROR_ENV);
+
+    /* The hint saves the scan of the cards and the connectors, but it
+     * knows only the main display */
+    mirror = env && atoi(env) > 0;
+    num_mirrors = 0;
+    hinted = !mirror && !drm_read_hint(&hint) &&
+             !drm_use_hint(&hint, &res, &selected_mode);
+    if (hinted) {
+        minor = hint.minor;
+    } else {
+        minor = drm_scan_cards(&res, &conns);
+        if (minor < 0) {
+            perror("cannot find/open a drm device");
+            goto exit_with_error;
+        }
     }
 
 
@@ -396,43 +983,118 @@ static GRSurface* drm_init(minui_backend* backend __unused, bool blank) {
 	}
 #endif
 
-    main_monitor_connector = find_main_monitor(drm_fd,
-            res, &selected_mode);
-    if (!main_monitor_connector) {
-        printf("main_monitor_connector not found\n");
-        goto exit_with_error;
-    }
+    if (!hinted) {
+        main_monitor_connector = find_main_monitor(&conns, &selected_mode);
+        if (!main_monitor_connector) {
+            printf("main_monitor_connector not found\n");
+            goto exit_with_error;
+        }
 
 
-    main_monitor_crtc = find_crtc_for_connector(drm_fd, res,
-                                                main_monitor_connector);
-    if (!main_monitor_crtc) {
-        printf("main_monitor_crtc not found\n");
-        goto exit_with_error;
+        main_monitor_crtc = find_crtc_for_connector(drm_fd, res,
+                                                    main_monitor_connector);
+        if (!main_monitor_crtc) {
+            printf("main_monitor_crtc not found\n");
+            goto exit_with_error;
+        }
+
+        if (mirror)
+            drm_setup_mirrors(drm_fd, res, &conns);
+        drm_free_connectors(&conns);
     }
 
 
     disable_non_main_crtcs(drm_fd,
                            res, main_monitor_crtc);
+    takeover = drm_crtc_has_mode(drm_fd, main_monitor_crtc,
+                                 main_monitor_connector,
+                                 &main_monitor_connector->modes[selected_mode]);
     main_monitor_crtc->mode = main_monitor_connector->modes[selected_mode];
+    main_monitor_connector_id = main_monitor_connector->connector_id;
     width = main_monitor_crtc->mode.hdisplay;
     height = main_monitor_crtc->mode.vdisplay;
 
+    /*
+     * The mirrors share the framebuffers, that are as large as the largest
+     * display. Every display scans out its mode centred in them and the
+     * drawing is restricted to the centred view of the main display: the
+     * same mode shows the same pixels, a larger one adds black borders and
+     * a smaller one crops the edges. The rendering costs the same with any
+     * number of displays.
+     */
+    fb_width = width;
+    fb_height = height;
+    for (i = 0; i < num_mirrors; i++) {
+        if (mirrors[i].mode.hdisplay > fb_width)
+            fb_width = mirrors[i].mode.hdisplay;
+        if (mirrors[i].mode.vdisplay > fb_height)
+            fb_height = mirrors[i].mode.vdisplay;
+    }
+    for (i = 0; i < num_mirrors; i++) {
+        mirrors[i].x = (fb_width - mirrors[i].mode.hdisplay) >> 1;
+        mirrors[i].y = (fb_height - mirrors[i].mode.vdisplay) >> 1;
+    }
+    main_monitor_x = (fb_width - width) >> 1;
+    main_monitor_y = (fb_height - height) >> 1;
+    drm_fb_width = fb_width;
+    drm_fb_height = fb_height;
 
-    drm_surfaces[0] = drm_create_surface(width, height);
-    drm_surfaces[1] = drm_create_surface(width, height);
-    if (!drm_surfaces[0] || !drm_surfaces[1]) {
-        drm_destroy_surface(drm_surfaces[0]);
-        drm_destroy_surface(drm_surfaces[1]);
-        goto exit_with_error;
+    TRACE_BEGIN("drm surfaces");
+    for (i = 0; i < DRM_NUM_BUFFERS; i++) {
+        drm_surfaces[i] = drm_create_surface(fb_width, fb_height);
+        if (!drm_surfaces[i]) {
+            while (i--)
+                drm_destroy_surface(drm_surfaces[i]);
+            goto exit_with_error;
+        }
+        drm_surface_view(drm_surfaces[i], main_monitor_x, main_monitor_y,
+                         width, height);
     }
 
-    get_ms_time_run();
+    TRACE_END("drm surfaces");
+
+    /* Unless the screen has to be blanked, start from what it shows, else
+     * from the new dumb buffers, zeroed by the kernel */
+    if (!blank && gr_inherit() && main_monitor_crtc->buffer_id &&
+            drm_surface_format() != DRM_FORMAT_RGB565)
+        inherited = drm_inherit_fb(drm_fd, main_monitor_crtc->buffer_id,
+                                   main_monitor_crtc->x, main_monitor_crtc->y,
+                                   drm_surfaces, DRM_NUM_BUFFERS);
 
     current_buffer = 0;
-    drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[1]);
+    front_buffer = -1;
+    pending_buffer = -1;
+    drm_frames = 0;
+    saved_on_screen = false;
+    drm_blanked = false;
 
-    get_ms_time_run(); //RAF: 0.290s are spent in drm_enable_crtc()
+    /* When the CRTC already scans out the mode, a page flip swaps in our
+     * buffer without the modeset and without its blink, else the full
+     * modeset is needed. A larger framebuffer for the mirrors needs it. */
+    TRACE_BEGIN("drm enable crtc");
+    if (takeover && fb_width == width && fb_height == height &&
+            !drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id,
+                             drm_surfaces[1]->fb_id,
+                             DRM_MODE_PAGE_FLIP_EVENT, &flip_pending)) {
+        flip_pending = 1;
+        pending_buffer = 1;
+    } else {
+        drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[1]);
+        front_buffer = 1;
+    }
+    drm_enable_mirrors(drm_fd, drm_surfaces[1]);
+    TRACE_END("drm enable crtc"); //RAF: 0.290s are spent in drm_enable_crtc()
+
+    if (!hinted) {
+        hint.minor = minor;
+        hint.connector_id = main_monitor_connector_id;
+        hint.crtc_id = main_monitor_crtc->crtc_id;
+        hint.clock = main_monitor_crtc->mode.clock;
+        hint.hdisplay = width;
+        hint.vdisplay = height;
+        hint.vrefresh = main_monitor_crtc->mode.vrefresh;
+        drm_write_hint(&hint);
+    }
 
     drmModeFreeConnector(main_monitor_connector);
     main_monitor_connector = NULL;
@@ -440,15 +1102,25 @@ static GRSurface* drm_init(minui_backend* backend __unused, bool blank) {
     res = NULL;
 
 
-    printf("drm init -> minor: %d, width: %d, height: %d\n",
-        minor, width, height);
+    printf("drm init -> minor: %d, width: %d, height: %d%s%s%s\n",
+        minor, width, height, hinted ? " (hint)" : "",
+        flip_pending ? " (takeover)" : "", inherited ? " (inherited)" : "");
+    for (i = 0; i < num_mirrors; i++)
+        printf("drm mirror -> connector: %u, width: %d, height: %d\n",
+            mirrors[i].connector_id, mirrors[i].mode.hdisplay,
+            mirrors[i].mode.vdisplay);
 
     return &(drm_surfaces[0]->base);
 
 exit_with_error:
+    drm_free_connectors(&conns);
     if(main_monitor_connector)
         drmModeFreeConnector(main_monitor_connector);
     main_monitor_connector = NULL;
+    if(main_monitor_crtc)
+        drmModeFreeCrtc(main_monitor_crtc);
+    main_monitor_crtc = NULL;
+    num_mirrors = 0;
     if(res)
         drmModeFreeResources(res);
     res = NULL;
@@ -461,23 +1133,108 @@ exit_with_error:
 static GRSurface* drm_flip(minui_backend* backend __unused) {
     (void)backend;
 
-    int ret;
+    struct drm_surface *surface = drm_surfaces[current_buffer];
+    int ret, next;
+
+    /* Only one flip at a time can be pending on a CRTC, a second one
+     * would fail with EBUSY: the previous one is over at the latest by
+     * the vblank that shows it, while this buffer was drawn. */
+    drm_wait_flip();
     ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id,
-                          drm_surfaces[current_buffer]->fb_id, 0, NULL);
+                          surface->fb_id, DRM_MODE_PAGE_FLIP_EVENT,
+                          &flip_pending);
     if (ret < 0) {
         printf("drmModePageFlip failed ret=%d\n", ret);
         return NULL;
     }
-    current_buffer = 1 - current_buffer;
+    flip_pending++;
+    for (int i = 0; i < num_mirrors; i++) {
+        if (drmModePageFlip(drm_fd, mirrors[i].crtc_id, surface->fb_id,
+                            DRM_MODE_PAGE_FLIP_EVENT, &flip_pending))
+            printf("drmModePageFlip failed on mirror %d\n", i);
+        else
+            flip_pending++;
+    }
+    surface->frame = ++drm_frames;
+    pending_buffer = current_buffer;
+
+    /* With two buffers the other one is on screen until the flip is done */
+    next = drm_next_buffer();
+    if (next < 0) {
+        drm_wait_flip();
+        next = drm_next_buffer();
+    }
+    current_buffer = next;
     return &(drm_surfaces[current_buffer]->base);
 }
 
+static int drm_buffer_age(minui_backend* backend __unused) {
+    (void)backend;
+
+    struct drm_surface *surface = drm_surfaces[current_buffer];
+
+    if (!surface->frame)
+        return 0;
+    return (int)(drm_frames - surface->frame + 1);
+}
+
+/* Put the buffer on screen aside, without copying it: it swaps place with
+ * a spare one, that is allocated the first time. */
+static void drm_save(minui_backend* backend __unused) {
+    (void)backend;
+
+    struct drm_surface *surface;
+
+    drm_wait_flip();
+    if (saved_on_screen || front_buffer < 0)
+        return;
+
+    if (!drm_saved) {
+        drm_saved = drm_create_surface(drm_fb_width, drm_fb_height);
+        if (!drm_saved) {
+            printf("can't allocate the buffer to save the screen\n");
+            return;
+        }
+        drm_surface_view(drm_saved, main_monitor_x, main_monitor_y,
+                         drm_surfaces[0]->base.width,
+                         drm_surfaces[0]->base.height);
+    }
+
+    surface = drm_surfaces[front_buffer];
+    drm_surfaces[front_buffer] = drm_saved;
+    drm_surfaces[front_buffer]->frame = 0;
+    drm_saved = surface;
+    saved_on_screen = true;
+}
+
+/* Scan out the saved screen again, also after a blank: attaching it is
+ * all it takes, nothing is redrawn. No modeset while it is on screen. */
+static void drm_restore(minui_backend* backend __unused) {
+    (void)backend;
+
+    drm_wait_flip();
+    if (!drm_saved || (saved_on_screen && !drm_blanked))
+        return;
+
+    drm_enable_crtc(drm_fd, main_monitor_crtc, drm_saved);
+    drm_enable_mirrors(drm_fd, drm_saved);
+    saved_on_screen = true;
+    drm_blanked = false;
+}
+
 static void drm_exit(minui_backend* backend __unused) {
     (void)backend;
 
+    drm_wait_flip();
     drm_disable_crtc(drm_fd, main_monitor_crtc);
-    drm_destroy_surface(drm_surfaces[0]);
-    drm_destroy_surface(drm_surfaces[1]);
+    drm_disable_mirrors(drm_fd);
+    num_mirrors = 0;
+    for (int i = 0; i < DRM_NUM_BUFFERS; i++)
+        drm_destroy_surface(drm_surfaces[i]);
+    drm_destroy_surface(drm_saved);
+    drm_saved = NULL;
+    saved_on_screen = false;
+    drm_blanked = false;
     drmModeFreeCrtc(main_monitor_crtc);
     if(main_monitor_connector)
         drmModeFreeConnector(main_monitor_connector);
@@ -491,8 +1248,9 @@ static minui_backend drm_backend = {
     .flip = drm_flip,
     .blank = drm_blank,
     .exit = drm_exit,
-    .save = NULL,
-    .restore = NULL,
+    .save = drm_save,
+    .restore = drm_restore,
+    .buffer_age = drm_buffer_age,
 };
 
 minui_backend* open_drm() {
@@ -35,17 +35,42 @@
 #include "graphics.h"
 #include "../yamui-tools.h"
 
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, __u32)
+#endif
+
+/* Set YAMUI_FB_VSYNC=0 in the environment to flip without waiting for
+ * the vertical blank, when the driver already waits for it to pan. */
+#define FB_VSYNC_ENV "YAMUI_FB_VSYNC"
+
 static gr_surface fbdev_init(minui_backend *, bool);
 static gr_surface fbdev_flip(minui_backend *);
 static void fbdev_blank(minui_backend *, bool);
 static void fbdev_exit(minui_backend *);
 static void fbdev_save(minui_backend *);
 static void fbdev_restore(minui_backend *);
+static int fbdev_buffer_age(minui_backend *);
+static void fbdev_damage(minui_backend *, int, int);
 
 static GRSurface gr_framebuffer[2];
 static bool double_buffered;
-static GRSurface *gr_draw = NULL;
 static int displayed_buffer;
+static bool wait_vsync;
+static bool pan_pending;
+
+/* Everything is drawn in a shadow in system memory, a flip copies to the
+ * framebuffer the rows that differ: the framebuffer is never read, that
+ * is very slow from the write-combined device memory, not even to save
+ * the screen. */
+static GRSurface *gr_draw = NULL;
+static bool shadow_shown;	/* it holds the last frame flipped */
+static bool shadow_on_screen;	/* nor has it been drawn over since */
+static bool damaged;		/* the rows drawn are known for this frame */
+static int stale_y1[2], stale_y2[2];	/* rows behind the shadow */
+
+/* Saved screen, run-length encoded: splash screens are mostly flat */
+static uint32_t *snapshot = NULL;
+static size_t snapshot_len;
 
 static struct fb_var_screeninfo vi;
 static int fb_fd = -1;
@@ -57,6 +82,8 @@ static minui_backend my_backend = {
 	.exit    = fbdev_exit,
 	.save    = fbdev_save,
 	.restore = fbdev_restore,
+	.buffer_age = fbdev_buffer_age,
+	.damage  = fbdev_damage,
 };
 
 /* ------------------------------------------------------------------------ */
@@ -82,17 +109,60 @@ fbdev_blank(minui_backend *backend UNUSED, bool blank)
 
 /* ------------------------------------------------------------------------ */
 
+/* Mark the rows y1 to y2 - 1 of every framebuffer as behind the shadow */
+static void
+stale_rows(int y1, int y2)
+{
+	int n;
+
+	for (n = 0; n < (double_buffered ? 2 : 1); n++) {
+		if (stale_y1[n] >= stale_y2[n]) {
+			stale_y1[n] = y1;
+			stale_y2[n] = y2;
+			continue;
+		}
+		if (y1 < stale_y1[n])
+			stale_y1[n] = y1;
+		if (y2 > stale_y2[n])
+			stale_y2[n] = y2;
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Wait for the vertical blank, once it fails it is not tried anymore. */
+static void
+fbdev_wait_vsync(void)
+{
+	__u32 crtc = 0;
+
+	if (!wait_vsync)
+		return;
+
+	if (ioctl(fb_fd, FBIO_WAITFORVSYNC, &crtc) < 0) {
+		perror("ioctl(): wait for vsync");
+		wait_vsync = false;
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* The virtual screen with both the buffers is set up once by init, a flip
+ * only moves the offset of the visible part. */
 static void
 set_displayed_framebuffer(unsigned n)
 {
 	if (n > 1 || !double_buffered)
 		return;
 
-	vi.yres_virtual = gr_framebuffer[0].height * 2;
 	vi.yoffset = n * gr_framebuffer[0].height;
-	vi.bits_per_pixel = gr_framebuffer[0].pixel_bytes * 8;
-	if (ioctl(fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0)
-		perror("active fb swap failed");
+	if (ioctl(fb_fd, FBIOPAN_DISPLAY, &vi) < 0) {
+		/* some drivers don't pan, but take the offset with the mode */
+		vi.yres_virtual = gr_framebuffer[0].height * 2;
+		vi.bits_per_pixel = gr_framebuffer[0].pixel_bytes * 8;
+		if (ioctl(fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0)
+			perror("active fb swap failed");
+	}
 
 	displayed_buffer = n;
 }
@@ -201,31 +271,61 @@ fbdev_init(minui_backend *backend, bool blank)
 		gr_framebuffer[1].data = gr_framebuffer[0].data +
 					 gr_framebuffer[0].height *
 					 gr_framebuffer[0].row_bytes;
-
-		gr_draw = gr_framebuffer + 1;
 	} else {
 		double_buffered = false;
+	}
 
-		/* Without double-buffering, we allocate RAM for a buffer to
-		 * draw in, and then "flipping" the buffer consists of a
-		 *memcpy from the buffer we allocated to the framebuffer. */
-
-		/* TODO: Check for error */
-		gr_draw = (GRSurface *)malloc(sizeof(GRSurface));
-		memcpy(gr_draw, gr_framebuffer, sizeof(GRSurface));
-		gr_draw->data = (unsigned char *)
-				malloc(gr_draw->height * gr_draw->row_bytes);
-		if (!gr_draw->data) {
-			perror("failed to allocate in-memory surface");
-			return NULL;
-		}
+	/* Either way we draw in RAM, and then "flipping" the buffer consists
+	 * of a memcpy from the buffer we allocated to the framebuffer, which
+	 * is panned to when double buffered. */
+	if (!(gr_draw = malloc(sizeof(GRSurface)))) {
+		perror("failed to allocate in-memory surface");
+		munmap(bits, fi.smem_len);
+		close(fd);
+		return NULL;
+	}
+	memcpy(gr_draw, gr_framebuffer, sizeof(GRSurface));
+	if (!(gr_draw->data = malloc(gr_draw->height * gr_draw->row_bytes))) {
+		perror("failed to allocate in-memory surface");
+		free(gr_draw);
+		gr_draw = NULL;
+		munmap(bits, fi.smem_len);
+		close(fd);
+		return NULL;
 	}
 
-	if (blank || !double_buffered)
+	/* Unless the screen has to be blanked or not inherited, start from what
+	 * it shows: the only time the framebuffer is read. */
+	if (blank || !gr_inherit() ||
+	    (vi.yoffset + vi.yres) * fi.line_length > fi.smem_len) {
 		memset(gr_draw->data, 0,
 		       gr_draw->height * gr_draw->row_bytes);
+		shadow_on_screen = blank;
+	} else {
+		memcpy(gr_draw->data,
+		       (unsigned char *)bits + vi.yoffset * fi.line_length,
+		       gr_draw->height * gr_draw->row_bytes);
+		/* the framebuffer 0 is the one kept on screen */
+		shadow_on_screen = !vi.yoffset;
+	}
 
 	fb_fd = fd;
+	shadow_shown = false;
+	damaged = false;
+
+	/* The first flip brings every framebuffer in sync with the shadow */
+	stale_y1[0] = stale_y2[0] = stale_y1[1] = stale_y2[1] = 0;
+	stale_rows(0, gr_draw->height);
+	pan_pending = false;
+	wait_vsync = !getenv(FB_VSYNC_ENV) || strcmp(getenv(FB_VSYNC_ENV), "0");
+
+	if (double_buffered) {
+		vi.yres_virtual = gr_framebuffer[0].height * 2;
+		vi.yoffset = 0;
+		vi.bits_per_pixel = gr_framebuffer[0].pixel_bytes * 8;
+		if (ioctl(fd, FBIOPUT_VSCREENINFO, &vi) < 0)
+			perror("failed to set up the double buffering");
+	}
 	set_displayed_framebuffer(0);
 
 	printf("framebuffer: %d (%d x %d)\n", fb_fd, gr_draw->width,
@@ -241,112 +341,239 @@ fbdev_init(minui_backend *backend, bool blank)
 
 /* ------------------------------------------------------------------------ */
 
-static gr_surface
-fbdev_flip(minui_backend *backend UNUSED)
+#if defined(RECOVERY_BGRA) || defined(RECOVERY_ARGB) || \
+    defined(RECOVERY_ALPHA)
+/* The framebuffer does not always switch to the selected mode, so let's
+ * keep these work-arounds in mind. The pixels are converted on their way
+ * to the framebuffer, the shadow keeps the layout it is drawn in. */
+static void
+fbdev_convert(unsigned char *dst, const unsigned char *src, size_t len)
 {
-	/* the framebuffer does not always switch to the selected mode,
-	 * so let's keep these work-arounds in mind */
+	unsigned char px[4];
+	size_t idx;
+
+	for (idx = 0; idx < len; idx += 4) {
+		memcpy(px, src + idx, 4);
 #if defined(RECOVERY_BGRA)
-	/* In case of BGRA, do some byte swapping */
-	unsigned int idx;
-	unsigned char tmp;
-	unsigned char *ucfb_vaddr = (unsigned char *)gr_draw->data;
-
-	for (idx = 0 ; idx < gr_draw->height * gr_draw->row_bytes; idx += 4) {
-		tmp = ucfb_vaddr[idx];
-		ucfb_vaddr[idx ] = ucfb_vaddr[idx + 2];
-		ucfb_vaddr[idx + 2] = tmp;
-	}
-#endif /* defined(RECOVERY_BGRA) */
+		/* In case of BGRA, do some byte swapping */
+		{
+			unsigned char tmp = px[0];
 
+			px[0] = px[2];
+			px[2] = tmp;
+		}
+#endif /* defined(RECOVERY_BGRA) */
 #if defined(RECOVERY_ARGB)
-	/* In case of ARGB, do some byte swapping */
-	unsigned int idx;
-	unsigned char tmp;
-	unsigned char *ucfb_vaddr = (unsigned char*)gr_draw->data;
-
-	for (idx = 0 ; idx < (gr_draw->height * gr_draw->row_bytes); idx += 4) {
-		tmp = ucfb_vaddr[idx];
-		ucfb_vaddr[idx ] = ucfb_vaddr[idx + 1];
-		ucfb_vaddr[idx + 1] = ucfb_vaddr[idx + 2];
-		ucfb_vaddr[idx + 2] = ucfb_vaddr[idx + 3];
-		ucfb_vaddr[idx + 3] = tmp;
-	}
+		/* In case of ARGB, do some byte swapping */
+		{
+			unsigned char tmp = px[0];
+
+			px[0] = px[1];
+			px[1] = px[2];
+			px[2] = px[3];
+			px[3] = tmp;
+		}
 #endif /* defined(RECOVERY_ARGB) */
-
 #if defined(RECOVERY_ALPHA)
-	/* we sometimes really need to set an alpha channel */
-	unsigned int idx;
-	unsigned char *ucfb_vaddr = (unsigned char *)gr_draw->data;
+		/* we sometimes really need to set an alpha channel */
+		px[3] = 0xff;
+#endif /* defined(RECOVERY_ALPHA) */
+		memcpy(dst + idx, px, 4);
+	}
+}
+#endif
 
-	for (idx = 0 ; idx < gr_draw->height * gr_draw->row_bytes; idx += 4)
-		ucfb_vaddr[idx + 3] = 0xff;
+/* ------------------------------------------------------------------------ */
 
-#endif /* defined(RECOVERY_ALPHA) */
+/* Bring the framebuffer n up to date with the shadow */
+static void
+fbdev_copy_rows(int n)
+{
+	int y1 = stale_y1[n], y2 = stale_y2[n];
+
+	if (y1 >= y2)
+		return;
+
+#if defined(RECOVERY_BGRA) || defined(RECOVERY_ARGB) || \
+    defined(RECOVERY_ALPHA)
+	fbdev_convert(gr_framebuffer[n].data + y1 * gr_draw->row_bytes,
+		      gr_draw->data + y1 * gr_draw->row_bytes,
+		      (y2 - y1) * gr_draw->row_bytes);
+#else
+	memcpy(gr_framebuffer[n].data + y1 * gr_draw->row_bytes,
+	       gr_draw->data + y1 * gr_draw->row_bytes,
+	       (y2 - y1) * gr_draw->row_bytes);
+#endif
+	stale_y1[n] = stale_y2[n] = 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static gr_surface
+fbdev_flip(minui_backend *backend UNUSED)
+{
+	if (!damaged)
+		stale_rows(0, gr_draw->height);
+	damaged = false;
 
 	if (double_buffered) {
-		/* Change gr_draw to point to the buffer currently displayed,
-		 * then flip the driver so we're displaying the other buffer
-		 * instead. */
-		gr_draw = gr_framebuffer + displayed_buffer;
-		set_displayed_framebuffer(1 - displayed_buffer);
+		int n = 1 - displayed_buffer;
+
+		/* The buffer to update was on screen until the vertical
+		 * blank that followed the last pan. */
+		if (pan_pending)
+			fbdev_wait_vsync();
+		fbdev_copy_rows(n);
+		set_displayed_framebuffer(n);
+		pan_pending = true;
 	} else {
-		/* Copy from the in-memory surface to the framebuffer. */
-		memcpy(gr_framebuffer[0].data, gr_draw->data,
-		       gr_draw->height * gr_draw->row_bytes);
+		/* Right after the vertical blank to stay ahead of the
+		 * scanout, if there is anything to copy at all. */
+		if (stale_y1[0] < stale_y2[0])
+			fbdev_wait_vsync();
+		fbdev_copy_rows(0);
 	}
 
+	shadow_shown = true;
+	shadow_on_screen = true;
 	return gr_draw;
 }
 
 /* ------------------------------------------------------------------------ */
 
+static void
+fbdev_damage(minui_backend *backend UNUSED, int y1, int y2)
+{
+	if (y1 < 0)
+		y1 = 0;
+	if (y2 > gr_draw->height)
+		y2 = gr_draw->height;
+
+	if (y1 < y2) {
+		stale_rows(y1, y2);
+		shadow_on_screen = false;
+	}
+	damaged = true;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+fbdev_buffer_age(minui_backend *backend UNUSED)
+{
+	/* the shadow is drawn over frame after frame */
+	return shadow_shown ? 1 : 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
 static void
 fbdev_exit(minui_backend *backend UNUSED)
 {
 	close(fb_fd);
 	fb_fd = -1;
 
-	if (!double_buffered && gr_draw) {
+	if (gr_draw) {
 		free(gr_draw->data);
 		free(gr_draw);
 	}
-
 	gr_draw = NULL;
+
+	free(snapshot);
+	snapshot = NULL;
 }
 
 /* ------------------------------------------------------------------------ */
 
-static void *save_buf[2] = { NULL, NULL };
+/* Run-length encoding of 32-bit words: a header word with the top bit set
+ * is a run of (header & 0x7fffffff) copies of the word that follows, else
+ * it is the count of the literal words that follow. Runs start at three
+ * words, so the output is never longer than the input plus one word. */
+static size_t
+rle_encode(const uint32_t *src, size_t len, uint32_t *dst)
+{
+	size_t i = 0, j, out = 0, lit = 0;
+	bool in_lit = false;
+
+	while (i < len) {
+		for (j = i + 1; j < len && src[j] == src[i] &&
+		     j - i < 0x7fffffff; j++)
+			;
+
+		if (j - i < 3) {
+			if (!in_lit || dst[lit] == 0x7fffffff) {
+				lit = out++;
+				dst[lit] = 0;
+				in_lit = true;
+			}
+			dst[out++] = src[i++];
+			dst[lit]++;
+			continue;
+		}
+
+		dst[out++] = 0x80000000 | (uint32_t)(j - i);
+		dst[out++] = src[i];
+		in_lit = false;
+		i = j;
+	}
+
+	return out;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+rle_decode(const uint32_t *src, size_t len, uint32_t *dst, size_t dst_len)
+{
+	const uint32_t *end = src + len;
+	uint32_t *dst_end = dst + dst_len;
+	size_t n;
+
+	while (src < end && dst < dst_end) {
+		n = *src & 0x7fffffff;
+		if (n > (size_t)(dst_end - dst))
+			n = dst_end - dst;
+
+		if (*src++ & 0x80000000) {
+			while (n--)
+				*dst++ = *src;
+			src++;
+		} else {
+			memcpy(dst, src, n * sizeof(*dst));
+			dst += n;
+			src += n;
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------ */
 
 static void
 fbdev_save(minui_backend *backend UNUSED)
 {
-	/* To prevent memory leak in a case when fbdev_save() was called
-	 * several times without calling of fbdev_restore(). */
-	if (save_buf[0])
+	size_t len = gr_draw->height * gr_draw->row_bytes / sizeof(uint32_t);
+	uint32_t *buf, *shrunk;
+
+	/* Drawn over, the shadow is not what the screen shows: no snapshot,
+	 * the restore flips the shadow in full instead */
+	if (!shadow_on_screen) {
+		free(snapshot);
+		snapshot = NULL;
 		return;
+	}
 
-	if (!(save_buf[0] = malloc(gr_draw->height * gr_draw->row_bytes))) {
+	/* worst case first, then only what it takes */
+	if (!(buf = malloc((len + 1) * sizeof(*buf)))) {
 		perror("Failed to allocate memory.");
 		return;
 	}
 
-	memcpy(save_buf[0], gr_framebuffer[0].data,
-	       gr_draw->height * gr_draw->row_bytes);
+	snapshot_len = rle_encode((const uint32_t *)gr_draw->data, len, buf);
+	if ((shrunk = realloc(buf, snapshot_len * sizeof(*buf))))
+		buf = shrunk;
 
-	if (double_buffered) {
-		if (!(save_buf[1] =
-			      malloc(gr_draw->height * gr_draw->row_bytes))) {
-			perror("Failed to allocate memory.");
-			/* Don't freeing save_buf[0] here since we have saved
-			 * successfully it. */
-			return;
-		}
-
-		memcpy(save_buf[1], gr_framebuffer[1].data,
-		       gr_draw->height * gr_draw->row_bytes);
-	}
+	free(snapshot);
+	snapshot = buf;
 }
 
 /* ------------------------------------------------------------------------ */
@@ -356,21 +583,15 @@ fbdev_restore(minui_backend *backend)
 {
 	fbdev_blank(backend, false);
 
-	if (save_buf[0]) {
-		memcpy(gr_framebuffer[0].data, save_buf[0],
-		       gr_draw->height * gr_draw->row_bytes);
-		free(save_buf[0]);
-		save_buf[0] = NULL;
-	}
-
-	if (save_buf[1]) {
-		memcpy(gr_framebuffer[1].data, save_buf[1],
-		       gr_draw->height * gr_draw->row_bytes);
-		free(save_buf[1]);
-		save_buf[1] = NULL;
-	}
+	if (snapshot)
+		rle_decode(snapshot, snapshot_len, (uint32_t *)gr_draw->data,
+			   gr_draw->height * gr_draw->row_bytes /
+			   sizeof(uint32_t));
 
+	/* flip it in full, it is on screen and in the shadow again */
+	damaged = false;
 	fbdev_flip(backend);
-	if (double_buffered)
-		fbdev_flip(backend);
+
+	/* not a frame that the caller has flipped */
+	shadow_shown = false;
 }
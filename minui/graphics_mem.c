@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2023, Roberto A. Foglietta <roberto.foglietta@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Headless backend: the frames are drawn in plain memory and presented to
+ * nobody, for testing and benchmarking without a display. It is selected
+ * with YAMUI_BACKEND=mem and set up with YAMUI_MEM, a comma separated list
+ * of:
+ *  mode=WIDTHxHEIGHT	1280x720 by default
+ *  format=FORMAT	xbgr8888 (the drawing one, default), xrgb8888 or
+ *			rgb565: a flip converts the frame into it
+ *  buffers=N		1 to MEM_MAX_BUFFERS, 3 by default
+ *  dump=DIR		write every frame flipped to DIR/frame-NNNNNN.EXT
+ *  dumpfmt=png|raw	png by default, raw is the frame in FORMAT
+ */
+
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "minui.h"
+#include "graphics.h"
+#include "../yamui-tools.h"
+
+#define MEM_ENV		"YAMUI_MEM"
+#define MEM_MAX_BUFFERS	8
+
+#define ARRAY_SIZE(A) (sizeof(A)/sizeof(*(A)))
+
+typedef enum {
+	mem_xbgr8888,	/* R, G, B, X bytes as graphics.c draws them */
+	mem_xrgb8888,	/* B, G, R, X */
+	mem_rgb565,
+} mem_format_t;
+
+static const char *const mem_format_names[] = {
+	[mem_xbgr8888] = "xbgr8888",
+	[mem_xrgb8888] = "xrgb8888",
+	[mem_rgb565]   = "rgb565",
+};
+
+struct mem_buffer {
+	GRSurface base;
+	unsigned long frame;	/* the last frame flipped from it, 0 if none */
+};
+
+static struct {
+	int width;
+	int height;
+	mem_format_t format;
+	int num_buffers;
+	char dump_dir[256];	/* empty to not dump */
+	bool dump_png;
+} mem_cfg;
+
+static struct mem_buffer mem_buffers[MEM_MAX_BUFFERS];
+static int mem_current;
+static unsigned char *mem_scanout;	/* the frame in mem_cfg.format */
+static unsigned char *mem_rgb;		/* the frame to write as PNG */
+
+/* Counters, printed at exit */
+static unsigned long mem_flips, mem_dumped, mem_blanks;
+
+static gr_surface mem_init(minui_backend *, bool);
+static gr_surface mem_flip(minui_backend *);
+static void mem_blank(minui_backend *, bool);
+static void mem_exit(minui_backend *);
+static int mem_buffer_age(minui_backend *);
+
+static minui_backend my_backend = {
+	.init    = mem_init,
+	.flip    = mem_flip,
+	.blank   = mem_blank,
+	.exit    = mem_exit,
+	.save    = NULL,
+	.restore = NULL,
+	.buffer_age = mem_buffer_age,
+};
+
+/* ------------------------------------------------------------------------ */
+
+minui_backend *
+open_mem(void)
+{
+	return &my_backend;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+mem_parse_option(const char *opt, size_t len)
+{
+	char val[256];
+	const char *eq = memchr(opt, '=', len);
+	unsigned i;
+
+	if (!eq || (size_t)(opt + len - eq) > sizeof(val))
+		return -1;
+	memcpy(val, eq + 1, opt + len - eq - 1);
+	val[opt + len - eq - 1] = '\0';
+	len = eq - opt;
+
+	if (len == 4 && !strncmp(opt, "mode", 4)) {
+		if (sscanf(val, "%dx%d", &mem_cfg.width, &mem_cfg.height) != 2 ||
+		    mem_cfg.width <= 0 || mem_cfg.height <= 0)
+			return -1;
+	} else if (len == 6 && !strncmp(opt, "format", 6)) {
+		for (i = 0; i < ARRAY_SIZE(mem_format_names); i++)
+			if (!strcmp(val, mem_format_names[i]))
+				break;
+		if (i == ARRAY_SIZE(mem_format_names))
+			return -1;
+		mem_cfg.format = i;
+	} else if (len == 7 && !strncmp(opt, "buffers", 7)) {
+		mem_cfg.num_buffers = atoi(val);
+		if (mem_cfg.num_buffers < 1 ||
+		    mem_cfg.num_buffers > MEM_MAX_BUFFERS)
+			return -1;
+	} else if (len == 4 && !strncmp(opt, "dump", 4)) {
+		strcpy(mem_cfg.dump_dir, val);
+	} else if (len == 7 && !strncmp(opt, "dumpfmt", 7)) {
+		if (!strcmp(val, "png"))
+			mem_cfg.dump_png = true;
+		else if (!strcmp(val, "raw"))
+			mem_cfg.dump_png = false;
+		else
+			return -1;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+mem_parse_config(void)
+{
+	const char *s = getenv(MEM_ENV), *end;
+	size_t len;
+
+	mem_cfg.width = 1280;
+	mem_cfg.height = 720;
+	mem_cfg.format = mem_xbgr8888;
+	mem_cfg.num_buffers = 3;
+	mem_cfg.dump_dir[0] = '\0';
+	mem_cfg.dump_png = true;
+
+	for (; s && *s; s = *end ? end + 1 : end) {
+		if (!(end = strchr(s, ',')))
+			end = s + strlen(s);
+		len = end - s;
+		if (len && mem_parse_option(s, len)) {
+			fprintf(stderr, "%s: invalid option \"%.*s\"\n", MEM_ENV,
+				(int)len, s);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static gr_surface
+mem_init(minui_backend *backend UNUSED, bool blank UNUSED)
+{
+	int i, bpp;
+
+	if (mem_parse_config())
+		return NULL;
+
+	for (i = 0; i < mem_cfg.num_buffers; i++) {
+		GRSurface *s = &mem_buffers[i].base;
+
+		s->width = mem_cfg.width;
+		s->height = mem_cfg.height;
+		s->pixel_bytes = 4;
+		s->row_bytes = s->width * s->pixel_bytes;
+		if (!(s->data = calloc(s->height, s->row_bytes))) {
+			perror("failed to allocate in-memory surface");
+			return NULL;
+		}
+		mem_buffers[i].frame = 0;
+	}
+
+	bpp = (mem_cfg.format == mem_rgb565) ? 2 : 4;
+	if (mem_cfg.format != mem_xbgr8888 &&
+	    !(mem_scanout = malloc(mem_cfg.width * mem_cfg.height * bpp))) {
+		perror("failed to allocate the scanout buffer");
+		return NULL;
+	}
+
+	if (mem_cfg.dump_dir[0] && mem_cfg.dump_png &&
+	    !(mem_rgb = malloc(mem_cfg.width * mem_cfg.height * 3))) {
+		perror("failed to allocate the dump buffer");
+		return NULL;
+	}
+
+	mem_current = 0;
+	mem_flips = mem_dumped = mem_blanks = 0;
+
+	printf("memory: %d x %d, %s, %d buffers%s%s\n", mem_cfg.width,
+	       mem_cfg.height, mem_format_names[mem_cfg.format],
+	       mem_cfg.num_buffers, mem_cfg.dump_dir[0] ? ", dump to " : "",
+	       mem_cfg.dump_dir);
+
+	return &mem_buffers[0].base;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* What a display controller would scan out, in the configured format */
+static const unsigned char *
+mem_convert(const GRSurface *s)
+{
+	const unsigned char *p = s->data;
+	unsigned n = s->width * s->height;
+	unsigned i;
+
+	switch (mem_cfg.format) {
+	case mem_xrgb8888: {
+		unsigned char *d = mem_scanout;
+
+		for (i = 0; i < n; i++, p += 4, d += 4) {
+			d[0] = p[2];
+			d[1] = p[1];
+			d[2] = p[0];
+			d[3] = p[3];
+		}
+		break;
+	}
+	case mem_rgb565: {
+		uint16_t *d = (uint16_t *)mem_scanout;
+
+		for (i = 0; i < n; i++, p += 4)
+			*d++ = ((p[0] & 0xf8) << 8) | ((p[1] & 0xfc) << 3) |
+			       (p[2] >> 3);
+		break;
+	}
+	default:
+		return s->data;
+	}
+
+	return mem_scanout;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+mem_dump(const GRSurface *s, const unsigned char *frame)
+{
+	char path[4096];
+	png_image image;
+	FILE *f;
+	unsigned i, n = s->width * s->height;
+	size_t size = n * ((mem_cfg.format == mem_rgb565) ? 2 : 4);
+
+	snprintf(path, sizeof(path), "%s/frame-%06lu.%s", mem_cfg.dump_dir,
+		 mem_flips, mem_cfg.dump_png ? "png" : "raw");
+
+	if (!mem_cfg.dump_png) {
+		if (!(f = fopen(path, "w"))) {
+			perror(path);
+			return;
+		}
+		if (fwrite(frame, 1, size, f) != size)
+			perror(path);
+		fclose(f);
+		mem_dumped++;
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		mem_rgb[i * 3 + 0] = s->data[i * 4 + 0];
+		mem_rgb[i * 3 + 1] = s->data[i * 4 + 1];
+		mem_rgb[i * 3 + 2] = s->data[i * 4 + 2];
+	}
+
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	image.width = s->width;
+	image.height = s->height;
+	image.format = PNG_FORMAT_RGB;
+
+	if (!png_image_write_to_file(&image, path, 0, mem_rgb, 0, NULL)) {
+		fprintf(stderr, "%s: %s\n", path, image.message);
+		return;
+	}
+	mem_dumped++;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static gr_surface
+mem_flip(minui_backend *backend UNUSED)
+{
+	struct mem_buffer *b = &mem_buffers[mem_current];
+	const unsigned char *frame = mem_convert(&b->base);
+
+	b->frame = ++mem_flips;
+	if (mem_cfg.dump_dir[0])
+		mem_dump(&b->base, frame);
+
+	mem_current = (mem_current + 1) % mem_cfg.num_buffers;
+	return &mem_buffers[mem_current].base;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+mem_buffer_age(minui_backend *backend UNUSED)
+{
+	unsigned long frame = mem_buffers[mem_current].frame;
+
+	return frame ? (int)(mem_flips - frame + 1) : 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+mem_blank(minui_backend *backend UNUSED, bool blank)
+{
+	if (blank)
+		mem_blanks++;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+mem_exit(minui_backend *backend UNUSED)
+{
+	int i;
+
+	printf("memory: %lu flips, %lu frames dumped, %lu blanks\n",
+	       mem_flips, mem_dumped, mem_blanks);
+
+	for (i = 0; i < MEM_MAX_BUFFERS; i++) {
+		free(mem_buffers[i].base.data);
+		mem_buffers[i].base.data = NULL;
+	}
+
+	free(mem_scanout);
+	mem_scanout = NULL;
+	free(mem_rgb);
+	mem_rgb = NULL;
+}
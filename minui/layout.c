@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2023, Roberto A. Foglietta <roberto.foglietta@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "minui.h"
+#include "graphics.h"
+
+#define LAYOUT_CACHE_SIZE 16
+
+typedef struct {
+	uint32_t hash;
+	gr_layout layout;
+} layout_entry;
+
+static layout_entry layout_cache[LAYOUT_CACHE_SIZE];
+static unsigned layout_next = 0;
+
+/* ------------------------------------------------------------------------ */
+
+/* FNV-1a, the key is compared in full on a hit anyway. */
+static uint32_t
+layout_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (uint8_t)*s++) * 16777619u;
+
+	return h;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+layout_free(gr_layout *l)
+{
+	free(l->text);
+	free(l->lines);
+	memset(l, 0, sizeof(*l));
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+layout_add_line(gr_layout *l, int *cap, const char *start, const char *end,
+		int width)
+{
+	gr_layout_line *line;
+
+	if (l->num_lines == *cap) {
+		int n = *cap ? *cap * 2 : 4;
+
+		if (!(line = realloc(l->lines, n * sizeof(*line)))) {
+			perror("can't allocate the text layout");
+			return -1;
+		}
+		l->lines = line;
+		*cap = n;
+	}
+
+	line = &l->lines[l->num_lines++];
+	line->start = start - l->text;
+	line->len = end - start;
+	line->width = width;
+
+	if (width > l->width)
+		l->width = width;
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Greedy wrapping: a line ends at its last space before the glyph that
+ * doesn't fit anymore, or right before it if there is no space, and the
+ * spaces at the break are dropped. Each glyph is measured only once. */
+static int
+layout_wrap(gr_layout *l)
+{
+	const char *p = l->text, *line = p, *brk = NULL, *next;
+	int w = 0, brk_w = 0, adv, cap = 0;
+
+	for (;;) {
+		if (!*p || *p == '\n') {
+			if (layout_add_line(l, &cap, line, p, w))
+				return -1;
+			if (!*p)
+				break;
+			line = ++p;
+			w = 0;
+			brk = NULL;
+			continue;
+		}
+
+		if (*p == ' ') {
+			brk = p;
+			brk_w = w;
+		}
+
+		next = p;
+		adv = gr_glyph_advance(&next, l->factor);
+
+		if (l->max_width > 0 && w + adv > l->max_width && p > line) {
+			if (brk && brk > line) {
+				if (layout_add_line(l, &cap, line, brk, brk_w))
+					return -1;
+				p = brk;
+			} else if (layout_add_line(l, &cap, line, p, w)) {
+				return -1;
+			}
+			while (*p == ' ')
+				p++;
+			line = p;
+			w = 0;
+			brk = NULL;
+			continue;
+		}
+
+		w += adv;
+		p = next;
+	}
+
+	l->line_height = gr_font_height(l->factor);
+	l->height = l->num_lines * (l->line_height + l->spacing) - l->spacing;
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+gr_layout_flush(void)
+{
+	unsigned i;
+
+	for (i = 0; i < LAYOUT_CACHE_SIZE; i++)
+		layout_free(&layout_cache[i].layout);
+}
+
+/* ------------------------------------------------------------------------ */
+
+const gr_layout *
+gr_layout_text(const char *s, int factor, int max_width, gr_align align,
+	       int spacing)
+{
+	unsigned i;
+	layout_entry *e;
+	uint32_t hash = layout_hash(s);
+
+	for (i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+		e = &layout_cache[i];
+		if (e->layout.text && e->hash == hash &&
+		    e->layout.factor == factor &&
+		    e->layout.max_width == max_width &&
+		    e->layout.align == align &&
+		    e->layout.spacing == spacing &&
+		    !strcmp(e->layout.text, s))
+			return &e->layout;
+	}
+
+	/* Round robin replacement, the cache is meant for a handful of
+	 * strings redrawn on every frame. */
+	e = &layout_cache[layout_next++ % LAYOUT_CACHE_SIZE];
+	layout_free(&e->layout);
+
+	if (!(e->layout.text = strdup(s))) {
+		perror("can't allocate the text layout");
+		return NULL;
+	}
+
+	e->hash = hash;
+	e->layout.factor = factor;
+	e->layout.max_width = max_width;
+	e->layout.align = align;
+	e->layout.spacing = spacing;
+
+	if (layout_wrap(&e->layout)) {
+		layout_free(&e->layout);
+		return NULL;
+	}
+
+	return &e->layout;
+}
+
+/* ------------------------------------------------------------------------ */
+
+int
+gr_layout_draw(const gr_layout *l, int kx, int ky, int bold, int row)
+{
+	int i, x, y, lx, pitch;
+
+	if (!l)
+		return 0;
+
+	pitch = l->line_height + l->spacing;
+	gr_text_origin(kx, ky, l->width, l->line_height, 0, &x, &y);
+
+	for (i = 0; i < l->num_lines; i++) {
+		const gr_layout_line *line = &l->lines[i];
+
+		lx = x;
+		if (l->align == GR_ALIGN_CENTER)
+			lx += (l->width - line->width) >> 1;
+		else if (l->align == GR_ALIGN_RIGHT)
+			lx += l->width - line->width;
+
+		gr_text_run(lx, y + (row + i) * pitch, l->text + line->start,
+			    line->len, bold, l->factor);
+	}
+
+	return l->num_lines;
+}
@@ -36,6 +36,14 @@ typedef struct {
 
 typedef GRSurface *gr_surface;
 
+/* Pick the backend gr_init() uses by name: "drm", "fbdev" or "mem", the
+ * headless one. NULL leaves it to YAMUI_BACKEND, or to probing if unset. */
+void gr_set_backend(const char *name);
+
+/* Whether gr_init() without blank starts from what the screen shows, the
+ * default. Else the buffers start black, still without a blank cycle. */
+void gr_set_inherit(bool inherit);
+
 /* To clear FB content during initialization set blank to true. */
 int  gr_init(bool blank);
 void gr_exit(void);
@@ -49,6 +57,21 @@ void gr_fb_blank(bool blank);
 GRSurface *gr_flip_n_copy(void);
 GRSurface *gr_flip(void);
 
+/* How many flips ago the drawing surface was last on screen, 0 when its
+ * content is unknown and it has to be repainted in full, and how many
+ * flips there have been so far: the content of the drawing surface is
+ * the frame number gr_frame_count() - gr_buffer_age() + 1. */
+int gr_buffer_age(void);
+unsigned gr_frame_count(void);
+
+/* Frame timing statistics of the last frames flipped: how long they took
+ * to draw and to flip, p50/p95/p99 and histograms, the frames missed and
+ * the frame rate. A frame is missed when it takes longer than the period,
+ * or than a 60 Hz refresh with no period, or comes that late after it.
+ * gr_stats_write() prints them to path, or to stdout for NULL or "-". */
+void gr_stats_period(int ms);
+int  gr_stats_write(const char *path);
+
 void gr_clear(void); /* clear entire surface to current color */
 void gr_color(unsigned char r, unsigned char g, unsigned char b,
 	      unsigned char a);
@@ -58,6 +81,52 @@ void gr_texticon(int x, int y, gr_surface icon);
 int  gr_measure(const char *s);
 void gr_font_size(int *x, int *y);
 
+/* Set up the compiled-in font, or /res/images/font.png when present. It is
+ * done on the first text drawn or measured, calling it earlier from another
+ * thread takes it off the display path. */
+void gr_init_font(void);
+
+/* Draw the text with a PSF1/PSF2 console font instead of the compiled-in
+ * one. Returns 0 on success, -1 if the file is missing or not a psf font. */
+int  gr_load_psf_font(const char *path);
+
+/* Text layout: the string is wrapped to max_width pixels at the spaces, or
+ * anywhere in the words longer than that, and at every '\n'. The layouts
+ * are cached by (string, factor, max_width, align, spacing), so a text that
+ * is drawn again and again is measured only the first time. */
+typedef enum {
+	GR_ALIGN_LEFT,
+	GR_ALIGN_CENTER,
+	GR_ALIGN_RIGHT,
+} gr_align;
+
+typedef struct {
+	int start;		/* offset of the line in text */
+	int len;		/* length of the line in bytes */
+	int width;		/* width of the line in pixels */
+} gr_layout_line;
+
+typedef struct {
+	char *text;
+	int factor;
+	int max_width;		/* <= 0 for no wrapping */
+	gr_align align;
+	int spacing;		/* pixels between the lines */
+	int width;		/* of the widest line */
+	int height;		/* of the whole block */
+	int line_height;
+	int num_lines;
+	gr_layout_line *lines;
+} gr_layout;
+
+/* Returns the layout owned by the cache, NULL if out of memory. */
+const gr_layout *gr_layout_text(const char *s, int factor, int max_width,
+				gr_align align, int spacing);
+
+/* Draw the block where gr_text() would draw it, starting at row rows of
+ * lines below. Returns the number of lines drawn. */
+int  gr_layout_draw(const gr_layout *layout, int kx, int ky, int bold, int row);
+
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy);
 unsigned int gr_get_width(gr_surface surface);
 unsigned int gr_get_height(gr_surface surface);
@@ -86,6 +155,31 @@ int  ev_wait(int timeout);
 int  ev_get_input(int fd, short revents, struct input_event *ev);
 void ev_dispatch(void);
 
+/* The event core under the ev_ functions, shared with the yamui tools: an
+ * epoll set dispatching only the fds that are ready, and the input devices
+ * /dev/input/event* that a filter accepts, watched with inotify, so the ones
+ * that probe later are added and the ones unplugged are removed. The
+ * callbacks get the epoll events, POLLIN and the like have the same values.
+ * A single loop per process, evloop_exit() closes all the fds it holds. */
+typedef int (*ev_device_filter)(int fd, const char *path);
+
+int  evloop_init(void);
+void evloop_exit(void);
+int  evloop_add_fd(int fd, ev_callback cb, void *data);
+int  evloop_del_fd(int fd);
+
+/* The filter returns 0 to accept the device, -1 to have it closed. */
+int  evloop_watch_input(ev_device_filter filter, ev_callback cb, void *data);
+
+/* Calls fn for each input device open until it returns non-zero. */
+int  evloop_for_each_input(int (*fn)(int fd, void *data), void *data);
+
+/* Waits like poll and returns the number of fds ready, 0 on timeout or -1
+ * with errno set, EINTR when a signal came. evloop_dispatch() calls their
+ * callbacks, the devices unplugged are removed without it. */
+int  evloop_wait(int timeout);
+void evloop_dispatch(void);
+
 /* Resources */
 
 /* res_create_*_surface() functions return 0 if no error, else
@@ -1,59 +1,339 @@
+/*
+ * Font compiler for minui.
+ *
+ * Reads a font and writes to stdout a C header with pre-expanded 8-bit alpha
+ * atlases, one per requested cell height, that graphics.c uses as they are:
+ * no decoding and no allocation at runtime.
+ *
+ * The input can be:
+ *  - nothing, the compiled-in 10x18 RLE font (font_10x18.h) is used;
+ *  - a grayscale PNG with the 96x2 array of the printable ASCII characters
+ *    0x20 - 0x7f, the top row is regular text and the bottom row is bold;
+ *  - a BDF font, the glyphs of the printable ASCII characters are taken.
+ *
+ * Each atlas is resampled from the source glyphs cell by cell with a box
+ * filter, so the sizes that are not an integer multiple of the source get
+ * anti-aliased edges instead of the blocky look of the integer scaling.
+ *
+ * Usage: mkfont [-s HEIGHT]... [FONT.png|FONT.bdf] > font_atlas.h
+ */
+
+#include <png.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "font_10x18.h"
+
+#define FIRST_CHAR	32
+#define NUM_CHARS	96
+#define MAX_SIZES	16
+#define SUPERSAMPLE	4
+
+typedef struct {
+	unsigned cwidth;
+	unsigned cheight;
+	unsigned rows;		/* 1 regular only, 2 regular and bold */
+	unsigned char *data;	/* NUM_CHARS * cwidth x rows * cheight */
+} src_font_t;
+
+/* ------------------------------------------------------------------------ */
+
+static int
+load_builtin(src_font_t *f)
+{
+	unsigned char *bits, data, *in = font.rundata;
+
+	f->cwidth = font.cwidth;
+	f->cheight = font.cheight;
+	f->rows = font.height / font.cheight;
+
+	if (!(f->data = malloc(font.width * font.height)))
+		return -1;
+
+	bits = f->data;
+	while ((data = *in++)) {
+		memset(bits, (data & 0x80) ? 255 : 0, data & 0x7f);
+		bits += (data & 0x7f);
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+load_png(src_font_t *f, const char *path)
+{
+	png_image image;
+
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+
+	if (!png_image_begin_read_from_file(&image, path)) {
+		fprintf(stderr, "%s: %s\n", path, image.message);
+		return -1;
+	}
+
+	image.format = PNG_FORMAT_GRAY;
+	if (image.width % NUM_CHARS || image.height % 2) {
+		fprintf(stderr, "%s: %ux%u is not a 96x2 array of glyphs\n",
+			path, image.width, image.height);
+		png_image_free(&image);
+		return -1;
+	}
+
+	if (!(f->data = malloc(PNG_IMAGE_SIZE(image)))) {
+		png_image_free(&image);
+		return -1;
+	}
+
+	if (!png_image_finish_read(&image, NULL, f->data, 0, NULL)) {
+		fprintf(stderr, "%s: %s\n", path, image.message);
+		free(f->data);
+		return -1;
+	}
+
+	f->cwidth = image.width / NUM_CHARS;
+	f->cheight = image.height / 2;
+	f->rows = 2;
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return c - 'A' + 10;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+load_bdf(src_font_t *f, const char *path)
+{
+	char line[256];
+	FILE *fp;
+	int fbb_w = 0, fbb_h = 0, fbb_x = 0, fbb_y = 0;
+	int enc = -1, bbx_w = 0, bbx_h = 0, bbx_x = 0, bbx_y = 0, row = -1;
+
+	if (!(fp = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+
+	f->data = NULL;
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, "FONTBOUNDINGBOX ", 16)) {
+			if (sscanf(line + 16, "%d %d %d %d", &fbb_w, &fbb_h,
+				   &fbb_x, &fbb_y) != 4 || fbb_w <= 0 ||
+			    fbb_h <= 0)
+				break;
+			f->cwidth = fbb_w;
+			f->cheight = fbb_h;
+			f->rows = 1;
+			f->data = calloc(NUM_CHARS * fbb_w, fbb_h);
+			if (!f->data)
+				break;
+		} else if (!strncmp(line, "ENCODING ", 9)) {
+			enc = atoi(line + 9);
+		} else if (!strncmp(line, "BBX ", 4)) {
+			sscanf(line + 4, "%d %d %d %d", &bbx_w, &bbx_h, &bbx_x,
+			       &bbx_y);
+		} else if (!strncmp(line, "BITMAP", 6)) {
+			row = 0;
+		} else if (!strncmp(line, "ENDCHAR", 7)) {
+			row = -1;
+		} else if (row >= 0 && f->data && enc >= FIRST_CHAR &&
+			   enc < FIRST_CHAR + NUM_CHARS) {
+			/* The glyph box is placed on the font baseline. */
+			int x, y = fbb_h + fbb_y - bbx_h - bbx_y + row++;
+			int nbits = strspn(line, "0123456789abcdefABCDEF") * 4;
+
+			if (y < 0 || y >= fbb_h)
+				continue;
+
+			for (x = 0; x < bbx_w && x < nbits; x++) {
+				int dx = bbx_x - fbb_x + x;
+
+				/* A digit at a time, the rows of the wide
+				 * glyphs are longer than any integer */
+				if (dx < 0 || dx >= fbb_w ||
+				    !((hexval(line[x / 4]) >> (3 - x % 4)) & 1))
+					continue;
+				f->data[y * NUM_CHARS * fbb_w +
+					(enc - FIRST_CHAR) * fbb_w + dx] = 255;
+			}
+		}
+	}
+
+	fclose(fp);
+	if (!f->data) {
+		fprintf(stderr, "%s: no usable FONTBOUNDINGBOX\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static unsigned
+cell_width(const src_font_t *f, unsigned cheight)
+{
+	unsigned cwidth = (f->cwidth * cheight + f->cheight / 2) / f->cheight;
+
+	return cwidth ? cwidth : 1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Resample one glyph cell with a SUPERSAMPLE x SUPERSAMPLE box filter. */
+static void
+scale_cell(const unsigned char *sp, unsigned src_row_bytes, unsigned scw,
+	   unsigned sch, unsigned char *dp, unsigned dst_row_bytes,
+	   unsigned dcw, unsigned dch)
+{
+	unsigned x, y, i, j;
+
+	for (y = 0; y < dch; y++)
+		for (x = 0; x < dcw; x++) {
+			unsigned sum = 0;
+
+			for (j = 0; j < SUPERSAMPLE; j++) {
+				unsigned sy = ((y * SUPERSAMPLE + j) * 2 + 1) *
+					      sch / (2 * SUPERSAMPLE * dch);
+
+				for (i = 0; i < SUPERSAMPLE; i++) {
+					unsigned sx = ((x * SUPERSAMPLE + i) *
+						       2 + 1) * scw /
+						      (2 * SUPERSAMPLE * dcw);
+
+					sum += sp[sy * src_row_bytes + sx];
+				}
+			}
+
+			dp[y * dst_row_bytes + x] = (sum +
+				SUPERSAMPLE * SUPERSAMPLE / 2) /
+				(SUPERSAMPLE * SUPERSAMPLE);
+		}
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+emit_atlas(const src_font_t *f, unsigned cheight)
+{
+	unsigned cwidth = cell_width(f, cheight);
+	unsigned width = NUM_CHARS * cwidth, height = f->rows * cheight;
+	unsigned src_row_bytes = NUM_CHARS * f->cwidth;
+	unsigned char *atlas;
+	unsigned c, r, n;
+
+	if (!(atlas = malloc(width * height))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (r = 0; r < f->rows; r++)
+		for (c = 0; c < NUM_CHARS; c++)
+			scale_cell(f->data + r * f->cheight * src_row_bytes +
+				   c * f->cwidth, src_row_bytes, f->cwidth,
+				   f->cheight, atlas + r * cheight * width +
+				   c * cwidth, width, cwidth, cheight);
+
+	printf("static const unsigned char font_atlas_%u[] = {", cheight);
+	for (n = 0; n < width * height; n++)
+		printf("%s0x%02x,", (n % 16) ? "" : "\n", atlas[n]);
+	printf("\n};\n\n");
+
+	free(atlas);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+cmp_unsigned(const void *a, const void *b)
+{
+	return *(const unsigned *)a - *(const unsigned *)b;
+}
+
+/* ------------------------------------------------------------------------ */
 
 int
 main(int argc, char *argv[])
 {
-	unsigned n;
-	unsigned char *x;
-	unsigned m;
-	unsigned run_val;
-	unsigned run_count;
+	unsigned sizes[MAX_SIZES], num_sizes = 0, i, n;
+	const char *path = NULL;
+	src_font_t f;
+	int opt, ret, size;
 
-	n = gimp_image.width * gimp_image.height;
-	m = 0;
-	x = gimp_image.pixel_data;
+	while ((opt = getopt(argc, argv, "s:h")) != -1) {
+		switch (opt) {
+		case 's':
+			if (num_sizes == MAX_SIZES || (size = atoi(optarg)) < 1) {
+				fprintf(stderr, "invalid size %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			sizes[num_sizes++] = size;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s HEIGHT]... "
+				"[FONT.png|FONT.bdf]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		path = argv[optind];
+
+	if (!path)
+		ret = load_builtin(&f);
+	else if (strlen(path) > 4 && !strcmp(path + strlen(path) - 4, ".bdf"))
+		ret = load_bdf(&f, path);
+	else
+		ret = load_png(&f, path);
+	if (ret)
+		return EXIT_FAILURE;
+
+	if (!num_sizes)
+		sizes[num_sizes++] = f.cheight;
+
+	/* Ascending and unique, graphics.c relies on it. */
+	qsort(sizes, num_sizes, sizeof(*sizes), cmp_unsigned);
+	for (i = n = 1; i < num_sizes; i++)
+		if (sizes[i] != sizes[n - 1])
+			sizes[n++] = sizes[i];
+	num_sizes = n;
 
-	printf("struct {\n");
+	printf("/* Generated by mkfont from %s, do not edit. */\n\n",
+	       path ? path : "the compiled-in font");
+
+	for (i = 0; i < num_sizes; i++)
+		emit_atlas(&f, sizes[i]);
+
+	printf("#define FONT_ATLAS_COUNT %u\n\n", num_sizes);
+	printf("static const struct {\n");
 	printf("\tunsigned width;\n");
 	printf("\tunsigned height;\n");
 	printf("\tunsigned cwidth;\n");
 	printf("\tunsigned cheight;\n");
-	printf("\tunsigned char rundata[];\n");
-	printf("} font = {\n");
-	printf("\t.width = %d,\n\t.height = %d,\n\t.cwidth = %d,\n"
-	       "\t.cheight = %d,\n",
-	       gimp_image.width, gimp_image.height, gimp_image.width / 96,
-	       gimp_image.height);
-	printf("\t.rundata = {\n");
-
-	run_val = (*x ? 0 : 255);
-	run_count = 1;
-	n--;
-	x += 3;
-
-	while (n-- > 0) {
-		unsigned val = (*x ? 0 : 255);
-
-		x += 3;
-		if (val == run_val && run_count < 127) {
-			run_count++;
-		} else {
-			printf("0x%02x,",
-			       run_count | (run_val ? 0x80 : 0x00));
-			run_val = val;
-			run_count = 1;
-			m += 5;
-			if (m >= 75) {
-				printf("\n");
-				m = 0;
-			}
-		}
+	printf("\tconst unsigned char *data;\n");
+	printf("} font_atlas[FONT_ATLAS_COUNT] = {\n");
+	for (i = 0; i < num_sizes; i++) {
+		unsigned cw = cell_width(&f, sizes[i]);
+
+		printf("\t{ %u, %u, %u, %u, font_atlas_%u },\n", NUM_CHARS * cw,
+		       f.rows * sizes[i], cw, sizes[i], sizes[i]);
 	}
+	printf("};\n");
 
-	printf("0x%02x,", run_count | (run_val ? 0x80 : 0x00));
-	printf("\n0x00,");
-	printf("\n");
-	printf("\t}\n};\n");
+	free(f.data);
 	return 0;
 }
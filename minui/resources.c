@@ -35,10 +35,7 @@
 #include <sys/types.h>
 
 #include "minui.h"
-
-#define MSTIME_HEADER_ONLY
-#define MSTIME_STATIC_VARS
-#include "../get_time_ms.c"
+#include "../trace.h"
 
 extern char *locale;
 
@@ -284,8 +281,7 @@ res_create_display_surface(const char *name, const char *dir, gr_surface *pSurfa
 		goto exit;
 	}
 
-	m_gettimems = -1;
-	get_ms_time_run();
+	TRACE_BEGIN("png decode");
 
 	for (uint_fast32_t y = 0; y < height; y++) {
 		png_read_row(png_ptr, p_row, NULL);
@@ -293,7 +289,7 @@ res_create_display_surface(const char *name, const char *dir, gr_surface *pSurfa
             channels, width);
 	}
 
-	get_ms_time_run();
+	TRACE_END("png decode");
 
 	free(p_row);
 	p_row = NULL;
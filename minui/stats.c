@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2023, Roberto A. Foglietta <roberto.foglietta@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Frame timing: graphics.c stamps each frame when its drawing starts, with
+ * the first primitive drawn after a flip, when it ends and the flip is
+ * submitted, and when the backend flip returns. The last GR_STATS_FRAMES
+ * frames are kept in a static ring, so recording costs four clock reads
+ * per frame and no allocation, and the report is computed from them.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "minui.h"
+#include "graphics.h"
+
+#define GR_STATS_FRAMES		1024
+#define GR_STATS_BUCKETS	24	/* powers of 2 from 1 us up */
+#define GR_STATS_BUDGET_NS	16666667LL	/* a 60 Hz refresh */
+
+typedef long long int nsec_t;
+
+typedef enum {
+	stat_draw,	/* draw start to draw end */
+	stat_flip,	/* flip submit to flip done */
+	stat_latency,	/* draw start to flip done */
+	stat_interval,	/* flip done to the next flip done */
+	stat_count,
+} stat_t;
+
+static const char *const stat_names[stat_count] = {
+	[stat_draw]     = "draw",
+	[stat_flip]     = "flip",
+	[stat_latency]  = "latency",
+	[stat_interval] = "interval",
+};
+
+static nsec_t stats_ring[GR_STATS_FRAMES][GR_STAMP_COUNT];
+static nsec_t stats_current[GR_STAMP_COUNT];
+static bool stats_drawing = false;
+
+static unsigned long stats_frames, stats_missed;
+static nsec_t stats_first_done, stats_last_done;
+static nsec_t stats_period_ns;
+
+/* Scratch for the percentiles, static like the ring */
+static nsec_t stats_sorted[GR_STATS_FRAMES];
+
+/* ------------------------------------------------------------------------ */
+
+static nsec_t
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+gr_stats_period(int ms)
+{
+	stats_period_ns = ms > 0 ? ms * 1000000LL : 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* A frame is missed when it takes longer than its budget to be drawn and
+ * flipped, the period if any or a 60 Hz refresh, or when it comes later
+ * than a budget after its slot of the period. */
+static bool
+stats_missed_frame(const nsec_t *t, nsec_t interval)
+{
+	nsec_t budget = stats_period_ns ? stats_period_ns : GR_STATS_BUDGET_NS;
+
+	if (t[GR_FLIP_DONE] - t[GR_DRAW_START] > budget)
+		return true;
+
+	return stats_period_ns && interval > stats_period_ns + budget;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+gr_stats_stamp(gr_stamp stamp)
+{
+	nsec_t t, *frame;
+
+	/* Stamped by every primitive, the clock is read by the first only */
+	if (stamp == GR_DRAW_START && stats_drawing)
+		return;
+
+	t = stats_now();
+	if (stamp == GR_DRAW_START) {
+		stats_current[GR_DRAW_START] = t;
+		stats_drawing = true;
+		return;
+	}
+
+	/* A flip of nothing drawn starts and ends at once */
+	if (!stats_drawing) {
+		stats_current[GR_DRAW_START] = t;
+		stats_drawing = true;
+	}
+
+	stats_current[stamp] = t;
+	if (stamp != GR_FLIP_DONE)
+		return;
+
+	frame = stats_ring[stats_frames % GR_STATS_FRAMES];
+	memcpy(frame, stats_current, sizeof(stats_current));
+
+	if (!stats_frames)
+		stats_first_done = t;
+	if (stats_missed_frame(frame, stats_frames ? t - stats_last_done : 0))
+		stats_missed++;
+
+	stats_last_done = t;
+	stats_frames++;
+	stats_drawing = false;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Value of the statistic for the i-th kept frame, -1 if there is none */
+static nsec_t
+stats_value(stat_t stat, unsigned long i, unsigned long first)
+{
+	const nsec_t *t = stats_ring[i % GR_STATS_FRAMES];
+
+	switch (stat) {
+	case stat_draw:
+		return t[GR_DRAW_END] - t[GR_DRAW_START];
+	case stat_flip:
+		return t[GR_FLIP_DONE] - t[GR_FLIP_SUBMIT];
+	case stat_latency:
+		return t[GR_FLIP_DONE] - t[GR_DRAW_START];
+	case stat_interval:
+		if (i == first)
+			return -1;
+		return t[GR_FLIP_DONE] -
+		       stats_ring[(i - 1) % GR_STATS_FRAMES][GR_FLIP_DONE];
+	default:
+		return -1;
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+cmp_nsec(const void *a, const void *b)
+{
+	nsec_t x = *(const nsec_t *)a, y = *(const nsec_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+stats_print_us(FILE *f, nsec_t ns)
+{
+	fprintf(f, " %9lld.%03lld", ns / 1000, ns % 1000);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+stats_report(FILE *f)
+{
+	unsigned long first, i, n, kept, hist[GR_STATS_BUCKETS];
+	nsec_t span = stats_last_done - stats_first_done;
+	int s, b, top;
+
+	kept = stats_frames < GR_STATS_FRAMES ? stats_frames : GR_STATS_FRAMES;
+	first = stats_frames - kept;
+
+	fprintf(f, "frames: %lu, missed: %lu, fps: ", stats_frames,
+		stats_missed);
+	if (stats_frames > 1 && span > 0)
+		fprintf(f, "%.2f\n", (stats_frames - 1) * 1e9 / span);
+	else
+		fprintf(f, "-\n");
+
+	if (!kept)
+		return;
+
+	fprintf(f, "last %lu frames, us:        p50           p95"
+		"           p99           max\n", kept);
+
+	for (s = 0; s < stat_count; s++) {
+		for (i = first, n = 0; i < stats_frames; i++)
+			if ((stats_sorted[n] = stats_value(s, i, first)) >= 0)
+				n++;
+		if (!n)
+			continue;
+
+		qsort(stats_sorted, n, sizeof(*stats_sorted), cmp_nsec);
+		fprintf(f, "  %-22s", stat_names[s]);
+		stats_print_us(f, stats_sorted[(n - 1) * 50 / 100]);
+		stats_print_us(f, stats_sorted[(n - 1) * 95 / 100]);
+		stats_print_us(f, stats_sorted[(n - 1) * 99 / 100]);
+		stats_print_us(f, stats_sorted[n - 1]);
+		fprintf(f, "\n");
+	}
+
+	/* The histograms, in power of 2 microsecond buckets */
+	for (s = 0; s < stat_count; s++) {
+		memset(hist, 0, sizeof(hist));
+		top = -1;
+		for (i = first, n = 0; i < stats_frames; i++) {
+			nsec_t us = stats_value(s, i, first) / 1000;
+
+			if (us < 0)
+				continue;
+			for (b = 0; b < GR_STATS_BUCKETS - 1 && us >= (2LL << b);
+			     b++)
+				;
+			hist[b]++;
+			if (b > top)
+				top = b;
+			n++;
+		}
+		if (!n)
+			continue;
+
+		fprintf(f, "%s histogram:\n", stat_names[s]);
+		for (b = 0; b <= top; b++) {
+			unsigned long bar = (hist[b] * 50 + n - 1) / n;
+
+			if (!hist[b])
+				continue;
+			fprintf(f, "  %9lld us %6lu ", b ? 1LL << b : 0LL,
+				hist[b]);
+			while (bar--)
+				fputc('#', f);
+			fputc('\n', f);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+
+int
+gr_stats_write(const char *path)
+{
+	FILE *f = stdout;
+
+	if (path && strcmp(path, "-") && !(f = fopen(path, "w"))) {
+		perror(path);
+		return -1;
+	}
+
+	stats_report(f);
+
+	if (f == stdout) {
+		fflush(f);
+		return 0;
+	}
+
+	if (fclose(f)) {
+		perror(path);
+		return -1;
+	}
+
+	return 0;
+}
@@ -17,19 +17,163 @@
 
 
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 
 #include "os-update.h"
 #include "minui/minui.h"
+#include "trace.h"
 
 #define MARGIN 10
+#define PRELOAD_MAX 32
+#define PROGRESS_HISTORY 4
 
 const char logo_filename[] = "test";
 
 extern long long int v_shift;
 
 static gr_surface logo;
+static bool logo_preloaded = false;
+
+static void (*overlay_draw)(void) = NULL;
+static unsigned overlay_since;
+
+/* The last frames of the progress bar, a buffer that still holds one of
+ * them is repainted only where the bar has changed since. */
+static struct {
+	unsigned frame;
+	int splitpoint;
+	gr_surface logo;
+} progress_history[PROGRESS_HISTORY];
+static unsigned progress_next = 0;
+
+/* Images decoded and font set up by the helper thread, ready counts what
+ * is done: the font first, then the images in order. */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool running;
+	int ready;
+	const char *dir;
+	const char *names[PRELOAD_MAX];
+	gr_surface images[PRELOAD_MAX];
+	int count;
+	const char *font_file;
+	bool text;
+	int font_ret;
+} preload = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* ------------------------------------------------------------------------ */
+
+static void
+preload_done(void)
+{
+	pthread_mutex_lock(&preload.lock);
+	preload.ready++;
+	pthread_cond_broadcast(&preload.cond);
+	pthread_mutex_unlock(&preload.lock);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+preload_wait(int ready)
+{
+	pthread_mutex_lock(&preload.lock);
+	while (preload.running && preload.ready < ready)
+		pthread_cond_wait(&preload.cond, &preload.lock);
+	pthread_mutex_unlock(&preload.lock);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void *
+preload_run(void *arg)
+{
+	int i;
+
+	(void)arg;
+
+	TRACE_BEGIN("preload");
+
+	/* The font first, the text is drawn before the images are shown */
+	if (preload.font_file)
+		preload.font_ret = gr_load_psf_font(preload.font_file);
+	if (preload.text && (!preload.font_file || preload.font_ret))
+		gr_init_font();
+	preload_done();
+
+	for (i = 0; i < preload.count; i++) {
+		if (res_create_display_surface(preload.names[i], preload.dir,
+					       &preload.images[i]) < 0)
+			preload.images[i] = NULL;
+		preload_done();
+	}
+
+	TRACE_END("preload");
+	return NULL;
+}
+
+/* ------------------------------------------------------------------------ */
+
+int
+osUpdatePreload(char **names, int count, const char *dir,
+		const char *font_file, bool text)
+{
+	int ret;
+
+	if (count > PRELOAD_MAX)
+		count = PRELOAD_MAX;
+
+	preload.dir = dir;
+	preload.count = count;
+	memcpy(preload.names, names, count * sizeof(*names));
+	preload.font_file = font_file;
+	preload.text = text;
+	preload.font_ret = 0;
+	preload.ready = 0;
+
+	if (!count && !text)
+		return 0;
+
+	/* running before the thread starts, a waiter can't miss it */
+	preload.running = true;
+	if ((ret = pthread_create(&preload.thread, NULL, preload_run, NULL))) {
+		fprintf(stderr, "ERROR: %s, pthread_create returned: %d.\n",
+			__func__, ret);
+		preload.running = false;
+		preload_run(NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+int
+osUpdatePreloadWait(void)
+{
+	preload_wait(1);
+	return preload.font_ret;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+preload_join(void)
+{
+	if (preload.running) {
+		pthread_join(preload.thread, NULL);
+		preload.running = false;
+	}
+}
 
 /* ------------------------------------------------------------------------ */
 
@@ -51,13 +195,57 @@ osUpdateScreenInit(bool blank)
 
 /* ------------------------------------------------------------------------ */
 
+/* The frame the drawing surface holds, 0 when unknown */
+static unsigned
+drawn_frame(void)
+{
+	int age = gr_buffer_age();
+
+	return age ? gr_frame_count() - age + 1 : 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+osUpdateScreenSetOverlay(void (*draw)(void))
+{
+	overlay_draw = draw;
+	overlay_since = gr_frame_count() + 1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+screen_flip(unsigned frame)
+{
+	if (overlay_draw && (!frame || frame < overlay_since))
+		overlay_draw();
+
+	gr_flip();
+}
+
+/* ------------------------------------------------------------------------ */
+
 int
 loadLogo(const char *filename, const char *dir)
 {
-	int ret = 0;
+	int i, ret = 0;
 
-	if (logo)
+	if (logo && !logo_preloaded)
 		res_free_surface(logo);
+	logo = NULL;
+	logo_preloaded = false;
+
+	for (i = 0; i < preload.count; i++) {
+		if (strcmp(preload.names[i], filename) || strcmp(preload.dir, dir))
+			continue;
+		preload_wait(i + 2);
+		if (!preload.images[i])
+			break;
+		logo = preload.images[i];
+		logo_preloaded = true;
+		return 0;
+	}
 
 	if ((ret = res_create_display_surface(filename, dir, &logo)) < 0)
 		fprintf(stderr, "ERROR: %s(%s), returned: %d.\n",
@@ -68,23 +256,28 @@ loadLogo(const char *filename, const char *dir)
 
 /* ------------------------------------------------------------------------ */
 
+static void
+logo_rect(int *dx, int *dy, int *logow, int *logoh)
+{
+    /* logo to middle of the screen */
+    *logow = gr_get_width(logo);
+    *logoh = gr_get_height(logo);
+    *dx = (gr_fb_width() - *logow) >> 1;
+    *dy = ((gr_fb_height() - *logoh) >> 1) + v_shift;
+}
+
 int
 gr_logo(void)
 {
+	int dx, dy, logow, logoh;
+
 	if (!logo) {
 		printf("No logo loaded\n");
 		return -1;
 	}
-	
-    /* draw logo to middle of the screen */
-    int fbw = gr_fb_width();
-    int fbh = gr_fb_height();
-    int logow = gr_get_width(logo);
-    int logoh = gr_get_height(logo);
-    int dx = (fbw - logow) >> 1;
-    int dy = (fbh - logoh) >> 1;
 
-    gr_blit(logo, 0, 0, logow, logoh, dx, dy + v_shift);
+	logo_rect(&dx, &dy, &logow, &logoh);
+	gr_blit(logo, 0, 0, logow, logoh, dx, dy);
 
 	return 0;
 }
@@ -97,8 +290,10 @@ showLogo(void)
         return -1;
     }
 
+    TRACE_BEGIN("showLogo");
     gr_logo();
-    gr_flip();
+    screen_flip(drawn_frame());
+    TRACE_END("showLogo");
 
     return 0;
 }
@@ -108,7 +303,11 @@ showLogo(void)
 void
 osUpdateScreenShowProgress(int percentage)
 {
-	int fbw, fbh, splitpoint, x1, x2, y1, y2;
+	int fbw, fbh, splitpoint, x1, x2, y1, y2, old = -1, i;
+	int dx, dy, logow, logoh;
+	unsigned frame = drawn_frame();
+
+	TRACE_BEGIN("progress");
 
 	fbw = gr_fb_width();
 	fbh = gr_fb_height();
@@ -118,29 +317,56 @@ osUpdateScreenShowProgress(int percentage)
 	assert(splitpoint >= 0);
 	assert(splitpoint <= fbw);
 
-	x1 = MARGIN;
+	/* What the buffer shows of the bar, if it is one of its frames */
+	for (i = 0; frame && i < PROGRESS_HISTORY; i++)
+		if (progress_history[i].frame == frame &&
+		    progress_history[i].logo == logo)
+			old = progress_history[i].splitpoint;
+
 	y1 = fbh / 2 + MARGIN;
-	x2 = MARGIN + splitpoint;
 	y2 = fbh / 2 + 20;
 
-	/* white color for the beginning of the progressbar */
-	gr_color(255, 255, 255, 255);
-
-	gr_fill(x1, y1, x2, y2);
-
-	/* Grey color for the end part of the progressbar */
-	gr_color(84, 84, 84, 255);
+	if (old < 0) {
+		/* white color for the beginning of the progressbar */
+		gr_color(255, 255, 255, 255);
+		gr_fill(MARGIN, y1, MARGIN + splitpoint, y2);
+
+		/* Grey color for the end part of the progressbar */
+		gr_color(84, 84, 84, 255);
+		gr_fill(MARGIN + splitpoint, y1, fbw - MARGIN, y2);
+
+		x1 = MARGIN;
+		x2 = fbw - MARGIN;
+	} else {
+		/* only the part between the old and the new split point */
+		if (splitpoint > old)
+			gr_color(255, 255, 255, 255);
+		else
+			gr_color(84, 84, 84, 255);
+
+		x1 = MARGIN + (splitpoint < old ? splitpoint : old);
+		x2 = MARGIN + (splitpoint > old ? splitpoint : old);
+		gr_fill(x1, y1, x2, y2);
+	}
 
-	x1 = MARGIN + splitpoint;
-	x2 = fbw - MARGIN;
+	/* draw logo on the top of the progress bar if it is loaded, again
+	 * only if the part repainted is under it */
+	if (logo) {
+		logo_rect(&dx, &dy, &logow, &logoh);
+		if (old < 0 || (x1 < x2 && x1 < dx + logow && dx < x2 &&
+				y1 < dy + logoh && dy < y2))
+			gr_logo();
+	}
 
-	gr_fill(x1, y1, x2, y2);
+	/* And finally draw everything */
+	screen_flip(frame);
 
-	/* draw logo on the top of the progress bar if it is loaded */
-	if (logo) gr_logo();
+	progress_history[progress_next % PROGRESS_HISTORY].frame = gr_frame_count();
+	progress_history[progress_next % PROGRESS_HISTORY].splitpoint = splitpoint;
+	progress_history[progress_next % PROGRESS_HISTORY].logo = logo;
+	progress_next++;
 
-	/* And finally draw everything */
-	gr_flip();
+	TRACE_END("progress");
 }
 
 /* ------------------------------------------------------------------------ */
@@ -148,8 +374,17 @@ osUpdateScreenShowProgress(int percentage)
 void
 osUpdateScreenExit(void)
 {
-	if (logo)
+	int i;
+
+	if (logo && !logo_preloaded)
 		res_free_surface(logo);
+	logo = NULL;
+
+	preload_join();
+	for (i = 0; i < preload.count; i++)
+		if (preload.images[i])
+			res_free_surface(preload.images[i]);
+	preload.count = 0;
 
 	gr_exit();
 }
@@ -10,6 +10,36 @@
  */
 int osUpdateScreenInit(bool blank);
 
+/*
+ * Decodes the images and sets up the font on a helper thread, meanwhile
+ * osUpdateScreenInit() probes and initializes the display.
+ * @param names of the images, as for loadLogo(), that takes them from here
+ * @param count number of the images
+ * @param dir directory with images
+ * @param font_file psf font to load, NULL for the compiled-in font
+ * @param text whether any text will be drawn, the font is not set up if not
+ * @return 0 when the thread started
+ * @return -1 when it didn't, the work has been done before returning
+ */
+int osUpdatePreload(char **names, int count, const char *dir,
+		    const char *font_file, bool text);
+
+/*
+ * Waits for the font set up by osUpdatePreload(), the images may still be
+ * decoding and loadLogo() waits only for the one it needs.
+ * @return 0 when the font file is loaded or there is none
+ * @return -1 when the font file failed to load
+ */
+int osUpdatePreloadWait(void);
+
+/*
+ * Sets what showLogo() and osUpdateScreenShowProgress() draw over their
+ * frames, once in each buffer: when its content is unknown or older than
+ * this call. The overlay must not overlap the logo nor the progress bar.
+ * @param draw function drawing the overlay, NULL for none
+ */
+void osUpdateScreenSetOverlay(void (*draw)(void));
+
 /*
  * Loads logo and overrides the old logo if already loaded.
  * @param filename of the file located in dir without extension or
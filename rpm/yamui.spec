@@ -31,5 +31,6 @@ make -j$(nproc)
 %{_bindir}/ustime
 %{_bindir}/nstime
 %{_bindir}/%{name}
+%{_bindir}/%{name}-inputd
 %{_bindir}/%{name}-powerkey
 %{_bindir}/%{name}-screensaverd
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2023, Roberto A. Foglietta <roberto.foglietta@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "trace.h"
+
+#define TRACE_THREADS	8
+#define TRACE_RING_SIZE	4096	/* records per thread, a power of 2 */
+
+typedef struct {
+	uint64_t ts;		/* ns of CLOCK_MONOTONIC */
+	const char *name;
+	char phase;		/* 'B'egin, 'E'nd or 'i'nstant */
+} trace_record;
+
+/* Written by its thread only, head is published after the record so the
+ * flush reads complete records. The oldest are overwritten when full. */
+typedef struct {
+	unsigned head;
+	pid_t tid;
+	trace_record records[TRACE_RING_SIZE];
+} trace_ring;
+
+static trace_ring trace_rings[TRACE_THREADS];
+static unsigned trace_rings_used;
+static unsigned trace_dropped;	/* events of the threads without a ring */
+
+static __thread trace_ring *trace_mine;
+static __thread int trace_no_ring;
+
+/* ------------------------------------------------------------------------ */
+
+static void
+trace_flush(void)
+{
+	const char *path = getenv(TRACE_ENV);
+	unsigned i, n, head, first;
+	const char *sep = "";
+	pid_t pid = getpid();
+	FILE *f;
+
+	if (!path || !*path)
+		path = TRACE_DEFAULT_PATH;
+
+	if (!(f = fopen(path, "w"))) {
+		perror(path);
+		return;
+	}
+
+	fprintf(f, "{\"traceEvents\":[");
+
+	n = __atomic_load_n(&trace_rings_used, __ATOMIC_ACQUIRE);
+	if (n > TRACE_THREADS)
+		n = TRACE_THREADS;
+
+	for (i = 0; i < n; i++) {
+		trace_ring *r = &trace_rings[i];
+
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+		for (; first < head; first++) {
+			const trace_record *e =
+				&r->records[first & (TRACE_RING_SIZE - 1)];
+
+			fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\","
+				"\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d%s}",
+				sep, e->name, e->phase,
+				(unsigned long long)(e->ts / 1000),
+				(unsigned long long)(e->ts % 1000), (int)pid,
+				(int)r->tid, e->phase == 'i' ? ",\"s\":\"t\"" :
+				"");
+			sep = ",";
+		}
+	}
+
+	fprintf(f, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":"
+		"{\"dropped\":%u}}\n",
+		__atomic_load_n(&trace_dropped, __ATOMIC_RELAXED));
+
+	if (fclose(f))
+		perror(path);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static trace_ring *
+trace_claim(void)
+{
+	unsigned i = __atomic_fetch_add(&trace_rings_used, 1, __ATOMIC_ACQ_REL);
+
+	if (i >= TRACE_THREADS) {
+		trace_no_ring = 1;
+		return NULL;
+	}
+
+	/* The first thread traced sets up the flush */
+	if (!i)
+		atexit(trace_flush);
+
+	trace_mine = &trace_rings[i];
+	trace_mine->tid = syscall(SYS_gettid);
+	return trace_mine;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+trace_event(const char *name, char phase)
+{
+	trace_ring *r = trace_mine;
+	trace_record *e;
+	struct timespec ts;
+	unsigned head;
+
+	if (!r && (trace_no_ring || !(r = trace_claim()))) {
+		__atomic_fetch_add(&trace_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	head = r->head;
+	e = &r->records[head & (TRACE_RING_SIZE - 1)];
+	e->ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	e->name = name;
+	e->phase = phase;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
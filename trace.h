@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2023, Roberto A. Foglietta <roberto.foglietta@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/*
+ * Tracing of the spans and instants that matter for the boot time: each
+ * event is a fixed size record stamped with CLOCK_MONOTONIC and stored in a
+ * ring of the calling thread, no lock, no formatting and no I/O on the way.
+ * At exit the rings are written as a Chrome trace-event JSON file, to the
+ * path in YAMUI_TRACE or to TRACE_DEFAULT_PATH, with the timestamps in us
+ * since boot as the kernel ones.
+ *
+ * Built with make TRACE=1 only, otherwise the macros are compiled out. The
+ * names must be string literals, only their address is recorded.
+ */
+
+#define TRACE_ENV		"YAMUI_TRACE"
+#define TRACE_DEFAULT_PATH	"/tmp/yamui-trace.json"
+
+#ifdef YAMUI_TRACE
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+void trace_event(const char *name, char phase);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#define TRACE_BEGIN(name)	trace_event(name, 'B')
+#define TRACE_END(name)		trace_event(name, 'E')
+#define TRACE_INSTANT(name)	trace_event(name, 'i')
+
+#else /* !YAMUI_TRACE */
+
+#define TRACE_BEGIN(name)	do { } while (0)
+#define TRACE_END(name)		do { } while (0)
+#define TRACE_INSTANT(name)	do { } while (0)
+
+#endif /* !YAMUI_TRACE */
+
+#endif /* _TRACE_H_ */
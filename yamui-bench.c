@@ -0,0 +1,673 @@
+/*
+ * Copyright (c) 2023, Roberto A. Foglietta <roberto.foglietta@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmarks of the minui pixel kernels and of the PNG loader, drawn on
+ * the headless memory backend: clear, opaque and blended fill, blit, text
+ * for the font factors 1 to 16, with its glyphs expanded and from the text
+ * cache, the PNG loading for each supported PNG format and the flip for
+ * each scanout format, at 720p, 1080p and 4K.
+ *
+ * Each case is run a few times as warmup, then timed RUNS times over at
+ * least MIN_MS milliseconds each, and the median run is reported as ns per
+ * pixel and MB/s of the pixels written. The results are also written as
+ * tab separated values to compare between builds, see -o and -c.
+ */
+
+#include <png.h>
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "yamui-tools.h"
+#include "minui/graphics.h"
+
+#define BENCH_MAX_MODES	8
+#define BENCH_MAX_RUNS	64
+#define BENCH_MAX_BASE	1024
+#define BENCH_FACTORS	16
+
+typedef struct bench_case bench_case;
+
+struct bench_case {
+	const char *kernel;
+	char param[32];
+	unsigned long pixels;	/* written by one call */
+	void (*fn)(const bench_case *c);
+	int factor;
+	const char *text;	/* one line for the text kernel */
+	int text_width;
+	GRSurface *source;	/* for the blit */
+	const char *png;	/* for the loader */
+	const char *dir;
+};
+
+typedef struct {
+	char key[96];
+	double ns_pixel;
+} bench_base;
+
+static const struct {
+	const char *name;
+	int width;
+	int height;
+} bench_default_modes[] = {
+	{ "720p",  1280,  720 },
+	{ "1080p", 1920, 1080 },
+	{ "4k",    3840, 2160 },
+};
+
+/* The scanout formats of the memory backend, the first is the native one */
+static const char *const bench_formats[] = {
+	"xbgr8888", "xrgb8888", "rgb565",
+};
+
+/* The PNG formats that res_create_display_surface() takes */
+static const struct {
+	const char *name;
+	png_uint_32 format;
+} bench_pngs[] = {
+	{ "rgb",     PNG_FORMAT_RGB },
+	{ "gray",    PNG_FORMAT_GRAY },
+	{ "palette", PNG_FORMAT_RGB_COLORMAP },
+};
+
+static struct {
+	int runs;
+	int warmup;
+	long min_ns;
+	const char *filter;
+	const char *out_path;
+	const char *base_path;
+} opts = { 5, 2, 20000000L, NULL, NULL, NULL };
+
+static int mode_width[BENCH_MAX_MODES], mode_height[BENCH_MAX_MODES];
+static int num_modes;
+
+static bench_base base[BENCH_MAX_BASE];
+static int num_base;
+
+static FILE *out;
+
+/* ------------------------------------------------------------------------ */
+
+static long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* ------------------------------------------------------------------------ */
+/* The kernels */
+
+static void
+run_clear(const bench_case *c UNUSED)
+{
+	gr_color(0x10, 0x20, 0x30, 255);
+	gr_clear();
+}
+
+static void
+run_clear_gray(const bench_case *c UNUSED)
+{
+	gr_color(0x40, 0x40, 0x40, 255);
+	gr_clear();
+}
+
+static void
+run_fill(const bench_case *c UNUSED)
+{
+	gr_color(0x10, 0x20, 0x30, 255);
+	gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+}
+
+static void
+run_fill_blend(const bench_case *c UNUSED)
+{
+	gr_color(0x10, 0x20, 0x30, 128);
+	gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+}
+
+static void
+run_blit(const bench_case *c)
+{
+	gr_blit(c->source, 0, 0, c->source->width, c->source->height, 0, 0);
+}
+
+/* Each line expands and blends its glyphs, the cache is flushed first */
+static void
+run_text(const bench_case *c)
+{
+	int y, lh = gr_font_height(c->factor), len = strlen(c->text);
+
+	gr_color(255, 255, 255, 255);
+	for (y = 0; y + lh <= gr_fb_height(); y += lh) {
+		gr_text_cache_flush();
+		gr_text_run(0, y, c->text, len, 0, c->factor);
+	}
+}
+
+/* The same lines blitted as the spans of the cached run */
+static void
+run_text_span(const bench_case *c)
+{
+	int y, lh = gr_font_height(c->factor), len = strlen(c->text);
+
+	gr_color(255, 255, 255, 255);
+	for (y = 0; y + lh <= gr_fb_height(); y += lh)
+		gr_text_run(0, y, c->text, len, 0, c->factor);
+}
+
+static void
+run_load(const bench_case *c)
+{
+	gr_surface s;
+
+	if (!res_create_display_surface(c->png, c->dir, &s))
+		res_free_surface(s);
+}
+
+static void
+run_flip(const bench_case *c UNUSED)
+{
+	gr_flip();
+}
+
+/* ------------------------------------------------------------------------ */
+
+static const bench_base *
+find_base(const bench_case *c, const char *mode)
+{
+	char key[96];
+	int i;
+
+	snprintf(key, sizeof(key), "%s\t%s\t%s", c->kernel, mode, c->param);
+	for (i = 0; i < num_base; i++)
+		if (!strcmp(base[i].key, key))
+			return &base[i];
+
+	return NULL;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+measure(const bench_case *c, const char *mode)
+{
+	double runs[BENCH_MAX_RUNS], median, ns_pixel, mb_s;
+	long long t, iters = 1;
+	const bench_base *b;
+	int i;
+
+	if (opts.filter && !strstr(c->kernel, opts.filter))
+		return;
+
+	for (i = 0; i < opts.warmup; i++)
+		c->fn(c);
+
+	/* As many calls as it takes for a run to last min_ns */
+	t = now_ns();
+	c->fn(c);
+	t = now_ns() - t;
+	if (t > 0 && t < opts.min_ns)
+		iters = (opts.min_ns + t - 1) / t;
+
+	for (i = 0; i < opts.runs; i++) {
+		long long n;
+
+		t = now_ns();
+		for (n = 0; n < iters; n++)
+			c->fn(c);
+		runs[i] = (double)(now_ns() - t) / iters;
+	}
+
+	qsort(runs, opts.runs, sizeof(*runs), cmp_double);
+	median = runs[opts.runs / 2];
+	ns_pixel = median / c->pixels;
+	mb_s = c->pixels * 4 / median * 1000.0;
+
+	printf("%-10s %-6s %-9s %10.3f ns/px %10.1f MB/s", c->kernel, mode,
+	       c->param, ns_pixel, mb_s);
+	if ((b = find_base(c, mode)))
+		printf("  x%.2f", b->ns_pixel / ns_pixel);
+	printf("\n");
+
+	if (out)
+		fprintf(out, "%s\t%s\t%s\t%lu\t%lld\t%.1f\t%.1f\t%.4f\t%.1f\n",
+			c->kernel, mode, c->param, c->pixels, iters, runs[0],
+			median, ns_pixel, mb_s);
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* A gradient with some noise, so the PNG doesn't compress to nothing. */
+static int
+write_png(const char *path, int width, int height, png_uint_32 format)
+{
+	png_image image;
+	unsigned char *data, colormap[256 * 3];
+	unsigned x, y, seed = 1, bpp = PNG_IMAGE_PIXEL_SIZE(format);
+	int ret;
+
+	if (!(data = malloc((size_t)width * height * bpp))) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (y = 0; y < (unsigned)height; y++)
+		for (x = 0; x < (unsigned)width * bpp; x++) {
+			seed = seed * 1103515245 + 12345;
+			data[y * width * bpp + x] = (x * 255 / (width * bpp)) ^
+						    ((seed >> 16) & 0x0f);
+		}
+
+	for (x = 0; x < 256; x++) {
+		colormap[x * 3 + 0] = x;
+		colormap[x * 3 + 1] = 255 - x;
+		colormap[x * 3 + 2] = x ^ 0x5a;
+	}
+
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	image.width = width;
+	image.height = height;
+	image.format = format;
+	image.colormap_entries = 256;
+
+	ret = png_image_write_to_file(&image, path, 0, data, 0, colormap);
+	if (!ret)
+		fprintf(stderr, "%s: %s\n", path, image.message);
+
+	free(data);
+	return ret ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Printable ASCII repeated for as long as it fits in a screen line */
+static char *
+text_line(int factor, int *width)
+{
+	int n = 0, w = 0, adv, size = 256;
+	char *s = malloc(size), *p;
+	const char *q;
+
+	if (!s)
+		return NULL;
+
+	for (;;) {
+		char ch = ' ' + 1 + n % 94;
+
+		q = &ch;
+		adv = gr_glyph_advance(&q, factor);
+		if (w + adv > gr_fb_width())
+			break;
+		if (n + 1 == size) {
+			if (!(p = realloc(s, size *= 2))) {
+				free(s);
+				return NULL;
+			}
+			s = p;
+		}
+		s[n++] = ch;
+		w += adv;
+	}
+
+	s[n] = '\0';
+	*width = w;
+	return s;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+bench_mode(int width, int height, const char *tmpdir)
+{
+	char mode[32], env[128], path[4096], name[64];
+	bench_case c;
+	GRSurface *source = NULL;
+	unsigned long pixels = (unsigned long)width * height;
+	unsigned i;
+
+	snprintf(mode, sizeof(mode), "%dx%d", width, height);
+	for (i = 0; i < sizeof(bench_default_modes) /
+			sizeof(*bench_default_modes); i++)
+		if (bench_default_modes[i].width == width &&
+		    bench_default_modes[i].height == height)
+			snprintf(mode, sizeof(mode), "%s",
+				 bench_default_modes[i].name);
+
+	for (i = 0; i < sizeof(bench_pngs) / sizeof(*bench_pngs); i++) {
+		snprintf(path, sizeof(path), "%s/%s-%s.png", tmpdir, mode,
+			 bench_pngs[i].name);
+		if (write_png(path, width, height, bench_pngs[i].format))
+			return -1;
+	}
+
+	for (i = 0; i < sizeof(bench_formats) / sizeof(*bench_formats); i++) {
+		snprintf(env, sizeof(env), "mode=%dx%d,format=%s,buffers=2",
+			 width, height, bench_formats[i]);
+		setenv("YAMUI_MEM", env, 1);
+
+		if (gr_init(true)) {
+			fprintf(stderr, "can't init the memory backend\n");
+			return -1;
+		}
+
+		memset(&c, 0, sizeof(c));
+		c.pixels = pixels;
+		c.dir = tmpdir;
+
+		if (i == 0) {
+			unsigned j;
+			int f;
+
+			c.kernel = "clear";
+			c.fn = run_clear;
+			strcpy(c.param, "rgb");
+			measure(&c, mode);
+			c.fn = run_clear_gray;
+			strcpy(c.param, "gray");
+			measure(&c, mode);
+
+			c.kernel = "fill";
+			c.fn = run_fill;
+			strcpy(c.param, "opaque");
+			measure(&c, mode);
+			c.fn = run_fill_blend;
+			strcpy(c.param, "blend");
+			measure(&c, mode);
+
+			snprintf(name, sizeof(name), "%s-rgb", mode);
+			if (!res_create_display_surface(name, tmpdir, &source)) {
+				c.kernel = "blit";
+				c.fn = run_blit;
+				c.source = source;
+				strcpy(c.param, "full");
+				measure(&c, mode);
+				res_free_surface(source);
+				c.source = NULL;
+			}
+
+			for (f = 1; f <= BENCH_FACTORS; f++) {
+				char *s = text_line(f, &c.text_width);
+				int lh = gr_font_height(f);
+
+				if (!s)
+					return -1;
+				c.factor = f;
+				c.text = s;
+				c.pixels = (unsigned long)c.text_width * lh *
+					   (height / lh);
+				snprintf(c.param, sizeof(c.param), "x%d", f);
+				if (c.pixels) {
+					c.kernel = "text";
+					c.fn = run_text;
+					measure(&c, mode);
+					c.kernel = "text-span";
+					c.fn = run_text_span;
+					measure(&c, mode);
+				}
+				free(s);
+			}
+			c.text = NULL;
+			c.pixels = pixels;
+
+			c.kernel = "load";
+			c.fn = run_load;
+			for (j = 0; j < sizeof(bench_pngs) / sizeof(*bench_pngs);
+			     j++) {
+				snprintf(name, sizeof(name), "%s-%s", mode,
+					 bench_pngs[j].name);
+				c.png = name;
+				snprintf(c.param, sizeof(c.param), "%s",
+					 bench_pngs[j].name);
+				measure(&c, mode);
+			}
+		}
+
+		c.kernel = "flip";
+		c.fn = run_flip;
+		snprintf(c.param, sizeof(c.param), "%s", bench_formats[i]);
+		measure(&c, mode);
+
+		gr_exit();
+	}
+
+	for (i = 0; i < sizeof(bench_pngs) / sizeof(*bench_pngs); i++) {
+		snprintf(path, sizeof(path), "%s/%s-%s.png", tmpdir, mode,
+			 bench_pngs[i].name);
+		unlink(path);
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+load_base(const char *path)
+{
+	char line[256], kernel[32], mode[32], param[32];
+	double ns_pixel;
+	FILE *f;
+
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) && num_base < BENCH_MAX_BASE) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%31s\t%31s\t%31s\t%*u\t%*d\t%*f\t%*f\t%lf",
+			   kernel, mode, param, &ns_pixel) != 4)
+			continue;
+		snprintf(base[num_base].key, sizeof(base[num_base].key),
+			 "%s\t%s\t%s", kernel, mode, param);
+		base[num_base++].ns_pixel = ns_pixel;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+parse_modes(const char *s)
+{
+	unsigned i;
+
+	for (num_modes = 0; *s && num_modes < BENCH_MAX_MODES; ) {
+		int w, h, n;
+
+		for (i = 0; i < sizeof(bench_default_modes) /
+				sizeof(*bench_default_modes); i++) {
+			n = strlen(bench_default_modes[i].name);
+			if (!strncmp(s, bench_default_modes[i].name, n) &&
+			    (s[n] == ',' || !s[n]))
+				break;
+		}
+
+		if (i < sizeof(bench_default_modes) /
+			sizeof(*bench_default_modes)) {
+			w = bench_default_modes[i].width;
+			h = bench_default_modes[i].height;
+		} else if (sscanf(s, "%dx%d%n", &w, &h, &n) != 2 ||
+			   w <= 0 || h <= 0 || (s[n] != ',' && s[n])) {
+			fprintf(stderr, "invalid mode \"%s\"\n", s);
+			return -1;
+		}
+
+		mode_width[num_modes] = w;
+		mode_height[num_modes++] = h;
+		s += n;
+		if (*s == ',')
+			s++;
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+print_help(const char *name)
+{
+	printf("Usage: %s [OPTIONS]\n", name);
+	printf("\n");
+	printf("  --modes=LIST, -m LIST\n");
+	printf("         Comma separated 720p, 1080p, 4k or WIDTHxHEIGHT, all the\n");
+	printf("         three by default\n");
+	printf("  --kernel=NAME, -k NAME\n");
+	printf("         Only the kernels whose name contains NAME: clear, fill,\n");
+	printf("         blit, text, text-span, load or flip\n");
+	printf("  --runs=N, -r N\n");
+	printf("         Timed runs of each case, the median is reported, %d\n",
+	       opts.runs);
+	printf("  --warmup=N, -w N\n");
+	printf("         Untimed calls before the runs, %d\n", opts.warmup);
+	printf("  --time=MS, -t MS\n");
+	printf("         Minimum length of a run in milliseconds, %ld\n",
+	       opts.min_ns / 1000000);
+	printf("  --output=FILE, -o FILE\n");
+	printf("         Write the results as tab separated values to FILE\n");
+	printf("  --compare=FILE, -c FILE\n");
+	printf("         Print the speedup over the results in FILE\n");
+	printf("  --help, -h\n");
+	printf("         Print this help\n");
+}
+
+/* ------------------------------------------------------------------------ */
+
+static struct option options[] = {
+	{"modes",   required_argument, 0, 'm'},
+	{"kernel",  required_argument, 0, 'k'},
+	{"runs",    required_argument, 0, 'r'},
+	{"warmup",  required_argument, 0, 'w'},
+	{"time",    required_argument, 0, 't'},
+	{"output",  required_argument, 0, 'o'},
+	{"compare", required_argument, 0, 'c'},
+	{"help",    no_argument,       0, 'h'},
+	{0, 0, 0, 0},
+};
+
+int
+main(int argc, char *argv[])
+{
+	char tmpdir[] = "/tmp/yamui-bench-XXXXXX";
+	int c, i, ret = EXIT_SUCCESS;
+
+	while ((c = getopt_long(argc, argv, "m:k:r:w:t:o:c:h", options,
+				NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			if (parse_modes(optarg))
+				return EXIT_FAILURE;
+			break;
+		case 'k':
+			opts.filter = optarg;
+			break;
+		case 'r':
+			opts.runs = atoi(optarg);
+			if (opts.runs < 1 || opts.runs > BENCH_MAX_RUNS) {
+				fprintf(stderr, "runs between 1 and %d\n",
+					BENCH_MAX_RUNS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'w':
+			opts.warmup = atoi(optarg);
+			break;
+		case 't':
+			opts.min_ns = atol(optarg) * 1000000L;
+			break;
+		case 'o':
+			opts.out_path = optarg;
+			break;
+		case 'c':
+			opts.base_path = optarg;
+			break;
+		case 'h':
+			print_help(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			print_help(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!num_modes)
+		for (i = 0; i < (int)(sizeof(bench_default_modes) /
+				      sizeof(*bench_default_modes)); i++) {
+			mode_width[num_modes] = bench_default_modes[i].width;
+			mode_height[num_modes++] = bench_default_modes[i].height;
+		}
+
+	if (opts.base_path && load_base(opts.base_path))
+		return EXIT_FAILURE;
+
+	if (opts.out_path) {
+		if (!(out = fopen(opts.out_path, "w"))) {
+			perror(opts.out_path);
+			return EXIT_FAILURE;
+		}
+		fprintf(out, "# yamui-bench runs=%d warmup=%d min_ms=%ld\n",
+			opts.runs, opts.warmup, opts.min_ns / 1000000);
+		fprintf(out, "# kernel\tmode\tparam\tpixels\titers\tmin_ns"
+			"\tmedian_ns\tns_pixel\tmb_s\n");
+	}
+
+	if (!mkdtemp(tmpdir)) {
+		perror(tmpdir);
+		return EXIT_FAILURE;
+	}
+
+	gr_set_backend("mem");
+	gr_init_font();
+
+	for (i = 0; i < num_modes; i++)
+		if (bench_mode(mode_width[i], mode_height[i], tmpdir)) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+	rmdir(tmpdir);
+	if (out && fclose(out)) {
+		perror(opts.out_path);
+		ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
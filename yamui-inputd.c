@@ -0,0 +1,272 @@
+/*
+ * Input daemon of the yamui tools. Opens the event devices that its tools
+ * want, once, and passes each input event to all of them: the Power key
+ * handler and the screen saver daemon. It is a multi-call binary and the
+ * name it is run by selects the tools:
+ *   yamui-powerkey     - the Power key handler alone, with its exit status,
+ *   yamui-screensaverd - the screen saver daemon alone,
+ *   yamui-inputd       - both in one process, until one of them ends.
+ *
+ * Copyright (c) 2023, Roberto A. Foglietta <roberto.foglietta@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*#define DEBUG*/
+#include "yamui-tools.h"
+
+#define ARRAY_SIZE(x)		(sizeof(x) / sizeof((x)[0]))
+#define MAX_OPTIONS		32
+
+const char *app_name = "inputd";
+sig_atomic_t volatile running = 1;
+
+static const input_tool_t *const all_tools[] = {
+	&powerkey_tool,
+	&screensaverd_tool,
+};
+
+static const input_tool_t *tools[ARRAY_SIZE(all_tools)];
+static ret_t tools_ret[ARRAY_SIZE(all_tools)];
+static event_mask_t tools_mask[ARRAY_SIZE(all_tools)];
+static size_t num_tools;
+
+/* What any tool wants, set on each device open */
+static event_mask_t input_mask;
+static bool input_mask_kernel = true;
+
+/* ------------------------------------------------------------------------ */
+
+static int
+tools_filter(int fd, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < num_tools; i++)
+		if (!tools[i]->filter(fd, name))
+			break;
+
+	if (i == num_tools)
+		return -1;
+
+	/* The timestamps of the events on the clock of the timers */
+	if (input_set_clock(fd))
+		errorf("Can't set the event clock of %s, stamping its events "
+		       "on read", name);
+
+	if (input_mask_kernel && event_mask_set(fd, &input_mask) == -1) {
+		if (errno == EINVAL) {
+			infof("No EVIOCSMASK, filtering the events in user space");
+			input_mask_kernel = false;
+		} else {
+			errorf("Can't set the event mask of %s", name);
+		}
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Each tool gets the events it wants until it is done with this wait */
+static ret_t
+tools_event(const struct input_event *ev)
+{
+	size_t i;
+
+	for (i = 0; i < num_tools; i++)
+		if (tools_ret[i] == ret_continue &&
+		    event_mask_test(&tools_mask[i], ev))
+			tools_ret[i] = tools[i]->event(ev);
+
+	return ret_continue;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+usage(void)
+{
+	size_t i;
+
+	if (num_tools > 1)
+		printf("Usage: yamui-%s [OPTIONS], running with the options of "
+		       "all its tools:\n\n", app_name);
+
+	for (i = 0; i < num_tools; i++) {
+		if (i)
+			printf("\n");
+		tools[i]->usage();
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+
+static const input_tool_t *
+tool_of_option(int opt)
+{
+	size_t i;
+
+	for (i = 0; i < num_tools; i++)
+		if (opt != ':' && strchr(tools[i]->optstring, opt))
+			return tools[i];
+
+	return NULL;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Returns 0, or the exit status if the options are not valid */
+static int
+parse_options(int argc, char *argv[])
+{
+	static struct option options[MAX_OPTIONS + 1];
+	char optstring[MAX_OPTIONS * 2 + 2] = "";
+	const struct option *o;
+	const input_tool_t *tool;
+	size_t i, n = 0;
+	int opt;
+
+	for (i = 0; i < num_tools; i++) {
+		strncat(optstring, tools[i]->optstring,
+			sizeof(optstring) - strlen(optstring) - 2);
+		for (o = tools[i]->options; o && o->name; o++)
+			if (n < MAX_OPTIONS)
+				options[n++] = *o;
+	}
+	strcat(optstring, "h");
+
+	while ((opt = getopt_long(argc, argv, optstring, options, NULL)) != -1) {
+		if (opt == 'h' || !(tool = tool_of_option(opt)) ||
+		    tool->option(opt, optarg)) {
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+signal_handler(int sig UNUSED)
+{
+	running = 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+int
+main(int argc, char *argv[])
+{
+	const char *name = strrchr(argv[0], '/');
+	int ret = EXIT_SUCCESS, ended = -1;
+	size_t i, started;
+
+	setlinebuf(stdout);
+	setlinebuf(stderr);
+
+	/* The personality, yamui-<tool>, else all the tools */
+	name = name ? name + 1 : argv[0];
+	if (!strncmp(name, "yamui-", 6))
+		name += 6;
+
+	for (i = 0; i < ARRAY_SIZE(all_tools); i++)
+		if (!strcmp(name, all_tools[i]->name)) {
+			tools[num_tools++] = all_tools[i];
+			app_name = all_tools[i]->name;
+		}
+
+	if (!num_tools)
+		for (i = 0; i < ARRAY_SIZE(all_tools); i++)
+			tools[num_tools++] = all_tools[i];
+
+	if ((ret = parse_options(argc, argv)))
+		return ret;
+
+	for (i = 0; i < num_tools; i++) {
+		tools[i]->events(&tools_mask[i]);
+		event_mask_merge(&input_mask, &tools_mask[i]);
+	}
+
+	if (open_input(tools_filter, tools_event) == -1)
+		return EXIT_FAILURE;
+
+	for (started = 0; started < num_tools; started++)
+		if (tools[started]->start()) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+	signal(SIGINT,  signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	while (running && started == num_tools) { /* Main loop */
+		ret_t r;
+
+		for (i = 0; i < num_tools; i++)
+			tools_ret[i] = ret_continue;
+
+		if (wait_input(-1, &r) < 0 && errno != EINTR) {
+			errorf("Error on epoll_wait()");
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		/* A device that can't be read any longer ends them all */
+		if (r == ret_failure) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		/* The first tool done ends them all */
+		for (i = 0; i < num_tools && ended < 0; i++)
+			if ((tools_ret[i] = tools[i]->wakeup(tools_ret[i])) !=
+			    ret_continue)
+				ended = i;
+
+		if (ended >= 0)
+			break;
+	}
+
+	/* The status is of the tool that ended, of the first on a signal */
+	while (started--) {
+		int status = tools[started]->stop(ended == (int)started ?
+						  tools_ret[started] :
+						  ret_continue);
+
+		if ((ended < 0 && !started && ret == EXIT_SUCCESS) ||
+		    ended == (int)started)
+			ret = status;
+	}
+
+	close_input();
+	printf("Terminated\n");
+	fflush(stdout);
+	fflush(stderr);
+	return ret;
+}
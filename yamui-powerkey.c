@@ -29,10 +29,6 @@
 #include <unistd.h>
 #include <stdbool.h>
 
-#include <sys/time.h>
-#include <sys/types.h>
-#include <sys/select.h>
-
 #include <linux/input.h>
 
 /*#define DEBUG*/
@@ -42,14 +38,24 @@
 #define BIT(arr, bit)		((arr[(bit) / __BITS_PER_LONG] >> \
 				 ((bit) % __BITS_PER_LONG)) & 1)
 
-#define MAX_DEVICES		256
 #define DEFAULT_DURATION	3 /* seconds */
+#define DEFAULT_DOUBLE_MS	400
+#define DEFAULT_CHORD_MS	200
 
 /* EXIT_SUCCESS and EXIT_FAILURE are defined in <stdlib.h>. */
 #define EXIT_SIGNAL		2
 
-const char *app_name = "powerkey";
-sig_atomic_t volatile running = 1;
+static gesture_config_t gestures = {
+	.long_ms	= DEFAULT_DURATION * 1000,
+	.double_ms	= 0,
+	.chord_ms	= DEFAULT_CHORD_MS,
+	.chord_key	= 0,
+};
+
+/* The gesture to exit on, and how to tell it */
+static gesture_t exit_gesture = gesture_long_press;
+static int double_ms = DEFAULT_DOUBLE_MS;
+static int chord_key = KEY_VOLUMEDOWN;
 
 /* ------------------------------------------------------------------------ */
 
@@ -70,7 +76,9 @@ check_device_type(int fd, const char *name)
 		if (ioctl(fd, EVIOCGBIT(EV_KEY, KEY_MAX), bits[EV_KEY]) == -1)
 			errorf("ioctl(, EVIOCGBIT(EV_KEY, ), ) error on event"
 			       " device %s", name);
-		else if (BIT(bits[EV_KEY], KEY_POWER)) {
+		else if (BIT(bits[EV_KEY], KEY_POWER) ||
+			 (gestures.chord_key &&
+			  BIT(bits[EV_KEY], gestures.chord_key))) {
 			debugf("Device %s supports needed key events.", name);
 			return 0;
 		}
@@ -82,229 +90,187 @@ check_device_type(int fd, const char *name)
 
 /* ------------------------------------------------------------------------ */
 
-static int duration = DEFAULT_DURATION;
-static struct timeval key_tv;
-
-typedef enum {
-	key_up,
-	key_down,
-	key_long_press
-} key_state_t;
-
-static key_state_t power_key_state = key_up;
+bool wait_key_up = false; /* Wait for key release event. */
+static ret_t gesture_ret = ret_continue;
 
-static struct timeval *
-get_timeout_value(void)
+static void
+handle_gesture(gesture_t g)
 {
-	if (power_key_state ==  key_down)
-		return &key_tv;
-	else /* key_up or key_long_press */
-		return NULL; /* Wait forever */
+	if (g == exit_gesture && !(g == gesture_long_press && wait_key_up))
+		gesture_ret = ret_success;
+	else if (g == gesture_long_release &&
+		 exit_gesture == gesture_long_press && wait_key_up)
+		gesture_ret = ret_success;
 }
 
 /* ------------------------------------------------------------------------ */
 
-static void
-set_timeout_value(int sec)
+/* Returns:
+ * ret_success	- Power key was pressed, terminate main loop.
+ * ret_continue	- Some other key was pressed or released, continue main loop.
+ */
+static ret_t
+handle_event(const struct input_event *ev)
 {
-	key_tv.tv_sec  = sec;
-	key_tv.tv_usec = 0;
+	gesture_event(ev);
+	return gesture_ret;
 }
 
 /* ------------------------------------------------------------------------ */
 
 static void
-reset_timeout_value(void)
+usage(void)
 {
-	key_tv.tv_sec  = duration;
-	key_tv.tv_usec = 0;
+	printf("Usage: yamui-powerkey [-d <key-press-duration>] [-u] "
+	       "[-g <gesture>]\n");
+	printf("\t\t[-i <ms>] [-c <key>] [-w <ms>]\n");
+	printf("-d <key-press-duration>\tThe Power key press period "
+	       "in seconds before exit,\n");
+	printf("\t\t\tdefault value: %d seconds, e.g. 1.5\n",
+	       DEFAULT_DURATION);
+	printf("-u\t\t\tExit on the key release event\n");
+	printf("-g <gesture>\t\tExit on a long, double or chord press "
+	       "of the Power key,\n");
+	printf("\t\t\tdefault value: long\n");
+	printf("-i <ms>\t\t\tThe longest interval of a double press,\n");
+	printf("\t\t\tdefault value: %d ms\n", DEFAULT_DOUBLE_MS);
+	printf("-c <key>\t\tThe key of the chord: volumedown, volumeup "
+	       "or a code,\n");
+	printf("\t\t\tdefault value: volumedown\n");
+	printf("-w <ms>\t\t\tThe longest interval between the keys of a "
+	       "chord,\n");
+	printf("\t\t\tdefault value: %d ms\n\n", DEFAULT_CHORD_MS);
+	printf("Return status:\n");
+	printf("%d - Power key was pressed,\n", EXIT_SUCCESS);
+	printf("%d - error happens,\n", EXIT_FAILURE);
+	printf("%d - signal received.\n", EXIT_SIGNAL);
 }
 
 /* ------------------------------------------------------------------------ */
 
-typedef enum {
-	key_ev_up,
-	key_ev_down
-} key_ev_t; /* Why <linux/input.h> still doesn't define it for us? */
-
-/* Returns:
- * ret_success	- Power key was pressed, terminate main loop.
- * ret_continue	- Some other key was pressed or released, continue main loop.
- */
-static ret_t
-handle_event(const struct input_event *ev)
+static int
+powerkey_option(int opt, const char *arg)
 {
-	if (ev->type != EV_KEY || ev->code != KEY_POWER) {
-		/* We are not recalculating timeout value in case of
-		 * "interrupted" key_down state because select() properly
-		 * updates timeout value on return. This behavior of select()
-		 * is Linux-specific, and on other platforms you have to
-		 * recalculate timeout value by your own. */
-		return ret_continue; /* Ignore other events and keys */
-	}
+	switch (opt) {
+	case 'd':
+		if ((gestures.long_ms = atof(arg) * 1000) < 1) {
+			printf("Duration value must be positive.\n");
+			return -1;
+		}
 
-	if (power_key_state == key_up) {
-		if (ev->value == key_ev_down) {
-			debugf("New state: key_down");
-			power_key_state = key_down;
-			reset_timeout_value();
-		} /* Else key_ev_up.
-		   * This can happen with multiple Power keys.
-		   * Ignore and keep timeout unchanged. */
-	} else if (power_key_state == key_down) {
-		if (ev->value == key_ev_up) {
-			debugf("New state: key_up");
-			power_key_state = key_up;
-		} /* Else key_ev_down.
-		   * This can happen with multiple Power keys. */
-	} else { /* key_long_press */
-		if (ev->value == key_ev_up)
-			return ret_success;
-		/* Else key_ev_down.
-		 * This can happen with multiple Power keys. */
-	}
+		break;
+	case 'u':
+		wait_key_up = true;
+		break;
+	case 'g':
+		if (!strcmp(arg, "long")) {
+			exit_gesture = gesture_long_press;
+		} else if (!strcmp(arg, "double")) {
+			exit_gesture = gesture_double_press;
+		} else if (!strcmp(arg, "chord")) {
+			exit_gesture = gesture_chord;
+		} else {
+			printf("Unknown gesture: %s.\n", arg);
+			return -1;
+		}
 
-	return ret_continue;
-}
+		break;
+	case 'i':
+		if ((double_ms = atoi(arg)) < 1) {
+			printf("Double press interval must be positive.\n");
+			return -1;
+		}
 
-/* ------------------------------------------------------------------------ */
+		break;
+	case 'c':
+		if (!strcmp(arg, "volumedown"))
+			chord_key = KEY_VOLUMEDOWN;
+		else if (!strcmp(arg, "volumeup"))
+			chord_key = KEY_VOLUMEUP;
+		else
+			chord_key = atoi(arg);
+
+		if (chord_key < 1 || chord_key >= KEY_CNT ||
+		    chord_key == KEY_POWER) {
+			printf("Unknown chord key: %s.\n", arg);
+			return -1;
+		}
 
-bool wait_key_up = false; /* Wait for key release event. */
+		break;
+	case 'w':
+		if ((gestures.chord_ms = atoi(arg)) < 1) {
+			printf("Chord interval must be positive.\n");
+			return -1;
+		}
 
-/* Returns:
- * ret_success	- Power key was pressed, terminate main loop.
- * ret_continue	- Some other key was pressed or released, continue main loop.
- * ret_failure	- Error happens, terminate the application. */
-static ret_t
-handle_timeout(void)
-{
-	if (power_key_state != key_down) { /* Should't be here. */
-		infof("Internal error: timeout in unexpected state: %d.\n",
-		      power_key_state);
-		return ret_failure;
+		break;
+	default:
+		return -1;
 	}
 
-	if (!wait_key_up)
-		return ret_success;
-
-	debugf("New state: key_long_press");
-	power_key_state = key_long_press;
-	return ret_continue;
+	return 0;
 }
 
 /* ------------------------------------------------------------------------ */
 
+/* Only what the gesture to exit on needs: no double press to wait for
+ * after a short press, no long press deadline while a double is told. */
 static void
-signal_handler(int sig UNUSED)
+powerkey_events(event_mask_t *mask)
 {
-	running = 0;
+	if (exit_gesture != gesture_long_press)
+		gestures.long_ms = 0;
+	if (exit_gesture == gesture_double_press)
+		gestures.double_ms = double_ms;
+	if (exit_gesture == gesture_chord)
+		gestures.chord_key = chord_key;
+
+	event_mask_add(mask, EV_KEY, KEY_POWER);
+	if (gestures.chord_key)
+		event_mask_add(mask, EV_KEY, gestures.chord_key);
 }
 
 /* ------------------------------------------------------------------------ */
 
-static void
-usage(void)
+static int
+powerkey_start(void)
 {
-	printf("Usage: yamui-%s [-d <key-press-duration>] [-u]\n", app_name);
-	printf("-d <key-press-duration>\tThe Power key press period "
-	       "in seconds before exit,\n");
-	printf("\t\t\tdefault value: %d seconds\n", DEFAULT_DURATION);
-	printf("-u\t\t\tExit on the key release event\n\n");
-	printf("Return status:\n");
-	printf("%d - Power key was pressed,\n", EXIT_SUCCESS);
-	printf("%d - error happens,\n", EXIT_FAILURE);
-	printf("%d - signal received.\n", EXIT_SIGNAL);
+	debugf("Started");
+	return gesture_init(&gestures, handle_gesture);
 }
 
 /* ------------------------------------------------------------------------ */
 
-int
-main(int argc, char *argv[])
+static ret_t
+powerkey_wakeup(ret_t r)
 {
-	int opt, fds[MAX_DEVICES], num_fds = 0, ret = EXIT_SIGNAL;
-
-	setlinebuf(stdout);
-	setlinebuf(stderr);
-
-	while ((opt = getopt(argc, argv, "d:hu")) != -1) {
-		switch (opt) {
-		case 'd':
-			duration = atoi(optarg);
-			if ((duration = atoi(optarg)) < 1) {
-				printf("Duration value must be positive.\n");
-				usage();
-				return EXIT_FAILURE;
-			}
-
-			break;
-		case 'u':
-			wait_key_up = true;
-			break;
-		case 'h':
-		default:
-			usage();
-			return EXIT_FAILURE;
-		}
-	}
+	if (r != ret_continue)
+		return r;
 
-	if (optind < argc) {
-		usage();
-		return EXIT_FAILURE;
-	}
+	gesture_wakeup();
+	return gesture_ret;
+}
 
-	if (open_fds(fds, &num_fds, MAX_DEVICES, check_device_type) == -1)
-		return EXIT_FAILURE;
+/* ------------------------------------------------------------------------ */
 
-	debugf("Started");
-	signal(SIGINT,  signal_handler);
-	signal(SIGTERM, signal_handler);
-	set_timeout_value(duration);
-
-	while (running) { /* Main loop */
-		int i, rv, max_fd = 0;
-		fd_set rfds;
-		struct timeval *tv;
-
-		FD_ZERO(&rfds);
-		for (i = 0; i < num_fds; i++) {
-			FD_SET(fds[i], &rfds);
-			if (fds[i] > max_fd)
-				max_fd = fds[i];
-		}
+static int
+powerkey_stop(ret_t r)
+{
+	return (r == ret_continue) ? EXIT_SIGNAL : get_exit_status(r);
+}
 
-		tv = get_timeout_value();
-		rv = select(max_fd + 1, &rfds, NULL, NULL, tv);
-		if (rv > 0) {
-			for (i = 0; i < num_fds; i++) {
-				if (FD_ISSET(fds[i], &rfds)) {
-					ret_t r;
-					r = handle_events(fds[i],
-							  handle_event);
-					if (r == ret_continue)
-						continue;
-					ret = get_exit_status(r);
-					running = 0;
-					break;
-				}
-			}
-		} else if (rv == 0) { /* Timeout */
-			ret_t r;
-			if ((r = handle_timeout()) == ret_continue)
-				continue;
-			ret = get_exit_status(r);
-			break;
-		} else { /* Error or signal */
-			if (errno != EINTR) {
-				errorf("Error on select()");
-				ret = EXIT_FAILURE;
-			}
-			break;
-		}
-	}
+/* ------------------------------------------------------------------------ */
 
-	close_fds(fds, num_fds);
-	printf("Terminated");
-	fflush(stdout);
-	fflush(stderr);
-	return ret;
-}
+const input_tool_t powerkey_tool = {
+	.name		= "powerkey",
+	.optstring	= "d:ug:i:c:w:",
+	.options	= NULL,
+	.usage		= usage,
+	.option		= powerkey_option,
+	.filter		= check_device_type,
+	.events		= powerkey_events,
+	.event		= handle_event,
+	.start		= powerkey_start,
+	.wakeup		= powerkey_wakeup,
+	.stop		= powerkey_stop,
+};
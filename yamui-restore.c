@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2023, Roberto A. Foglietta <roberto.foglietta@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The screen kept across the display off by yamui-screensaverd, when set
+ * with DISPLAY_RESTORE. The only user of the minui graphics in the input
+ * tools: built with make DISPLAY_RESTORE=1 alone, see yamui-tools.h.
+ */
+
+#include "yamui-tools.h"
+#include "minui/minui.h"
+
+/* ------------------------------------------------------------------------ */
+
+/* Opened without blanking, the screen content is inherited */
+int
+restore_init(void)
+{
+	return gr_init(false);
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+restore_save(void)
+{
+	gr_save();
+	gr_fb_blank(true);
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+restore_show(void)
+{
+	gr_restore();
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+restore_exit(void)
+{
+	gr_exit();
+}
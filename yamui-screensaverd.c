@@ -21,17 +21,22 @@
 
 #define _DEFAULT_SOURCE
 
+#include <fcntl.h>
+#include <spawn.h>
 #include <errno.h>
 #include <stdio.h>
+#include <getopt.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include <sys/wait.h>
-#include <sys/time.h>
 #include <sys/types.h>
-#include <sys/select.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 
 #include <linux/input.h>
 
@@ -45,13 +50,31 @@
 
 #define DISPLAY_CONTROL		"/sys/class/graphics/fb0/blank"
 #define DISPLAY_CONTROL_DRM	"/sys/class/backlight/panel0-backlight/brightness"
-#define MAX_DEVICES		    256
-#define DISPLAY_OFF_TIME     30 /* seconds */
 
-static const bool display_off_disabled = 1; //RAF: a user space script does
+/* Set DISPLAY_RESTORE=1 in the environment to keep what the screen shows
+ * across the display off: it is saved before and attached again after,
+ * not redrawn. The display is opened without blanking it, so this has to
+ * be the only client of a drm device. Built with make DISPLAY_RESTORE=1. */
+#define DISPLAY_RESTORE_ENV	"DISPLAY_RESTORE"
 
-const char *app_name = "screensaverd";
-sig_atomic_t volatile running = 1;
+#define DEFAULT_FADE_STEPS	16
+
+static sig_atomic_t volatile print_stats = 0;
+
+/* Seconds of inactivity before the display is turned off, 0 to never do it:
+ * RAF: a user space script does by default. The timer is armed only then and
+ * on activity, otherwise the daemon sleeps until an input event. */
+static int display_off_time = 0;
+static int display_off_fd = -1;
+static bool input_activity = false;
+
+static bool show_stats = false;
+static struct {
+	unsigned long wakeups;	/* returns of the wait */
+	unsigned long input;	/* of them with input events */
+	unsigned long timer;	/* of them with the display off timer */
+	unsigned long fade;	/* of them with a fade step */
+} stats;
 
 char *display_control = NULL;
 int display_control_off_value = 1;
@@ -64,6 +87,24 @@ typedef enum {
 } display_state_t;
 
 static display_state_t display_state = state_unknown;
+static bool display_restore = false;
+static bool display_blanked = false;
+
+/* The display control node is opened once and written with pwrite(). With
+ * a backlight, whose max_brightness is read at start, the display can fade
+ * in and out over fade_ms: fade_steps writes paced by a timerfd, of which
+ * those of a level unchanged are skipped. */
+static int fade_ms = 0;
+static int fade_steps = DEFAULT_FADE_STEPS;
+
+static struct {
+	int fd;			/* of display_control, -1 if not open */
+	int max;		/* max_brightness, -1 if not a backlight */
+	int level;		/* last written, -1 if unknown */
+	int from, to;		/* levels of the fade */
+	int step;		/* of the fade, fade_steps when none runs */
+	int timer_fd;		/* pacing the fade steps, -1 without fades */
+} brightness = { -1, -1, -1, 0, 0, DEFAULT_FADE_STEPS, -1 };
 
 /* ------------------------------------------------------------------------ */
 
@@ -112,68 +153,400 @@ check_device_type(int fd, const char *name)
 /* ------------------------------------------------------------------------ */
 
 static int
-sysfs_write_int(const char *fname, int val)
+sysfs_read_int(const char *fname)
 {
-	FILE *f;
+	char buf[16];
+	ssize_t rv;
+	int fd;
+
+	if ((fd = open(fname, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	rv = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (rv <= 0)
+		return -1;
+
+	buf[rv] = 0;
+	return atoi(buf);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+brightness_write(int level)
+{
+	char buf[16];
+	int len;
+
+	if (brightness.fd < 0 &&
+	    (brightness.fd = open(display_control, O_WRONLY | O_CLOEXEC)) < 0) {
+		errorf("Can't open \"%s\" for writing", display_control);
+		return -1;
+	}
 
-	if (!(f = fopen(fname, "w"))) {
-		errorf("Can't open \"%s\" for writing", fname);
+	len = snprintf(buf, sizeof(buf), "%d\n", level);
+	if (pwrite(brightness.fd, buf, len, 0) != len) {
+		errorf("Can't write \"%s\"", display_control);
 		return -1;
 	}
 
-	fprintf(f, "%d\n", val);
-	fclose(f);
+	brightness.level = level;
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* The display off is complete: the screen is put aside and blanked */
+static void
+display_faded(void)
+{
+	if (display_state != state_off || !display_restore || display_blanked)
+		return;
+
+	restore_save();
+	display_blanked = true;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+brightness_stop_fade(void)
+{
+	struct itimerspec its;
+
+	if (brightness.step >= fade_steps)
+		return;
+
+	brightness.step = fade_steps;
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(brightness.timer_fd, 0, &its, NULL);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+brightness_fade_step(int fd, short revents UNUSED, void *data UNUSED)
+{
+	uint64_t expirations;
+	int level;
+
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations) ||
+	    brightness.step >= fade_steps)
+		return 0;
+
+	stats.fade++;
+
+	/* The ticks missed under load are caught up with a single write */
+	if (expirations >= (uint64_t)(fade_steps - brightness.step))
+		brightness_stop_fade();
+	else
+		brightness.step += expirations;
+
+	level = brightness.from +
+		(brightness.to - brightness.from) * brightness.step / fade_steps;
+	if (level != brightness.level)
+		brightness_write(level);
+
+	if (brightness.step >= fade_steps)
+		display_faded();
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Go to level over fade_ms, or at once when fading is off or impossible */
+static int
+brightness_fade(int level)
+{
+	struct itimerspec its;
+	long long step_ns;
+	int ret;
+
+	if (!fade_ms || brightness.timer_fd < 0 || brightness.level < 0) {
+		brightness_stop_fade();
+		ret = brightness_write(level);
+		display_faded();
+		return ret;
+	}
+
+	brightness.from = brightness.level;
+	brightness.to = level;
+	brightness.step = 0;
+
+	step_ns = fade_ms * 1000000LL / fade_steps;
+	its.it_value.tv_sec = step_ns / 1000000000;
+	its.it_value.tv_nsec = step_ns % 1000000000;
+	its.it_interval = its.it_value;
+	if (timerfd_settime(brightness.timer_fd, 0, &its, NULL) == -1) {
+		errorf("Can't arm the fade timer");
+		brightness.step = fade_steps;
+		ret = brightness_write(level);
+		display_faded();
+		return ret;
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+open_brightness(void)
+{
+	const char *base = strrchr(display_control, '/');
+	char path[PATH_MAX];
+
+	brightness.step = fade_steps; /* No fade running */
+
+	/* Reported at the first write if it fails */
+	brightness.fd = open(display_control, O_WRONLY | O_CLOEXEC);
+
+	/* Of a backlight, its range and level are read once */
+	if (!base || strcmp(base + 1, "brightness"))
+		return;
+
+	snprintf(path, sizeof(path), "%.*s/max_brightness",
+		 (int)(base - display_control), display_control);
+	if ((brightness.max = sysfs_read_int(path)) <= 0)
+		return;
+
+	brightness.level = sysfs_read_int(display_control);
+	if (display_control_on_value > brightness.max)
+		display_control_on_value = brightness.max;
+
+	if (!fade_ms)
+		return;
+
+	brightness.timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					     TFD_NONBLOCK | TFD_CLOEXEC);
+	if (brightness.timer_fd == -1) {
+		errorf("Can't create the fade timer, no fades");
+	} else if (evloop_add_fd(brightness.timer_fd, brightness_fade_step,
+				 NULL)) {
+		close(brightness.timer_fd);
+		brightness.timer_fd = -1;
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* The PWKEY_CMD_FILE hook is spawned without a shell and without waiting
+ * for it: its first line of output, the pid of what it started, is read by
+ * the event loop and it is reaped on SIGCHLD, through a signalfd. */
+static struct {
+	pid_t pid;		/* 0 when it is not running */
+	int out_fd;		/* read end of its stdout, -1 once read */
+	char out[16];
+	size_t len;
+} pwkey_cmd = { 0, -1, "", 0 };
+
+static int sigchld_fd = -1;
+
+extern char **environ;
+
+/* ------------------------------------------------------------------------ */
+
+static void
+pwkey_cmd_close_output(const char *fname)
+{
+	int pid;
+
+	evloop_del_fd(pwkey_cmd.out_fd);
+	close(pwkey_cmd.out_fd);
+	pwkey_cmd.out_fd = -1;
+
+	pwkey_cmd.out[strcspn(pwkey_cmd.out, "\n")] = 0;
+	printf("posix_spawn(%s) read proc pid: %s\n", fname, pwkey_cmd.out);
+	if ((pid = atoi(pwkey_cmd.out)) < 2)
+		fprintf(stderr, "ERROR: pid(%d, %s) is not valid\n", pid,
+			pwkey_cmd.out);
+	fflush(stdout);
+	fflush(stderr);
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Only the first line is wanted: the pipe is closed as soon as it is read,
+ * since the process started by the hook may keep it open. */
+static int
+pwkey_cmd_output(int fd, short revents UNUSED, void *data)
+{
+	char buf[64];
+	ssize_t rv;
+	size_t n;
+
+	while ((rv = read(fd, buf, sizeof(buf))) > 0) {
+		n = sizeof(pwkey_cmd.out) - 1 - pwkey_cmd.len;
+		if ((size_t)rv < n)
+			n = rv;
+		memcpy(pwkey_cmd.out + pwkey_cmd.len, buf, n);
+		pwkey_cmd.len += n;
+		pwkey_cmd.out[pwkey_cmd.len] = 0;
+
+		if (memchr(buf, '\n', rv) ||
+		    pwkey_cmd.len == sizeof(pwkey_cmd.out) - 1)
+			break;
+	}
+
+	if (rv < 0 && errno == EAGAIN)
+		return 0;
+	if (rv < 0)
+		errorf("Can't read the output of %s", (const char *)data);
+
+	pwkey_cmd_close_output(data);
 	return 0;
 }
 
 /* ------------------------------------------------------------------------ */
 
 static int
-turn_display_on(void)
+pwkey_cmd_reap(int fd, short revents UNUSED, void *data)
 {
-    int ret = sysfs_write_int(display_control, display_control_on_value);
+	struct signalfd_siginfo si;
+	int status;
+	pid_t pid;
+
+	while (read(fd, &si, sizeof(si)) == sizeof(si))
+		;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		if (pid != pwkey_cmd.pid)
+			continue;
+
+		pwkey_cmd.pid = 0;
+		if (pwkey_cmd.out_fd >= 0) /* What it wrote before exiting */
+			pwkey_cmd_output(pwkey_cmd.out_fd, 0, data);
+		if (WIFSIGNALED(status))
+			fprintf(stderr, "ERROR: %s killed by signal %d\n",
+				(const char *)data, WTERMSIG(status));
+		else if (WEXITSTATUS(status))
+			fprintf(stderr, "ERROR: %s exited with status %d\n",
+				(const char *)data, WEXITSTATUS(status));
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+open_sigchld(const char *fname)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+		errorf("Can't block SIGCHLD");
+		return -1;
+	}
+
+	sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigchld_fd == -1) {
+		errorf("Can't open a signalfd for SIGCHLD");
+		return -1;
+	}
+
+	if (evloop_add_fd(sigchld_fd, pwkey_cmd_reap, (void *)fname)) {
+		close(sigchld_fd);
+		sigchld_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+run_pwkey_cmd(const char *fname)
+{
+	char *argv[] = { (char *)fname, NULL };
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	int fds[2], rv;
+	sigset_t mask;
+
+	if (pwkey_cmd.pid || pwkey_cmd.out_fd >= 0) {
+		printf("%s still running, not started again\n", fname);
+		return;
+	}
+
+	if (sigchld_fd < 0 && open_sigchld(fname))
+		return;
+
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		errorf("Can't create the pipe for %s", fname);
+		return;
+	}
+
+	/* The child gets the pipe as stdout and SIGCHLD unblocked */
+	sigemptyset(&mask);
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	rv = posix_spawn(&pwkey_cmd.pid, fname, &actions, &attr, argv, environ);
+	if (rv == ENOEXEC) {
+		/* A script without #!, that popen() ran through the shell */
+		char *sh_argv[] = { "/bin/sh", (char *)fname, NULL };
+
+		rv = posix_spawn(&pwkey_cmd.pid, sh_argv[0], &actions, &attr,
+				 sh_argv, environ);
+	}
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[1]);
+
+	if (rv) {
+		fprintf(stderr, "ERROR: posix_spawn(%s) failed, errno(%d): %s\n",
+			fname, rv, strerror(rv));
+		pwkey_cmd.pid = 0;
+		close(fds[0]);
+		return;
+	}
+
+	pwkey_cmd.len = 0;
+	pwkey_cmd.out[0] = 0;
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	if (evloop_add_fd(fds[0], pwkey_cmd_output, (void *)fname)) {
+		close(fds[0]);
+		return;
+	}
+	pwkey_cmd.out_fd = fds[0];
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+turn_display_on(bool run_hook)
+{
+    int ret;
     const char *const act = (display_state != state_on) ? "Turning" : "Refresh";
     printf("%s display on.\n", act);
-    display_state = state_on;
 
-#if 0
-#ifdef __arm___
-	gr_restore(); /* Qualcomm specific. TODO: implement generic solution. */
-#endif /* __arm__ */
-#endif
+    display_state = state_on;
+    if (display_blanked) {
+        restore_show();
+        display_blanked = false;
+    }
+    ret = brightness_fade(display_control_on_value);
 
     //RAF: this way is much simpler but the file should be executable. On the
     //     other side, the excutable flag could be pourposely switched to enable
     //     or disable the execution of the command by the yamui-screensaverd.
     static char *fname = NULL;
     if(!fname) fname = getenv("PWKEY_CMD_FILE");
-    if(!fname) goto func_return;
-
-    char str[16];
-    FILE *pf = popen(fname, "r");
-    if(!pf) {
-        fprintf(stderr,"ERROR: popen(%s) failed, errno(%d): %s\n",
-            fname, errno, strerror(errno));
-        goto func_return;
-    }
-    if(fgets(str, sizeof(str), pf)) {
-        for(int i = sizeof(str)-1; i >= 0; i--)
-            if(str[i] == '\n') str[i] = 0;
-        printf("popen(%s) on fileno(%d) read proc pid: %s\n",
-            fname, fileno(pf), str);
-        int pid = atoi(str);
-        if(pid < 2)
-            fprintf(stderr,"ERROR: pid(%d, %s) is not valid\n", pid, str);
-    } else {
-        fprintf(stderr,"ERROR: fgets(%s) failed, errno(%d): %s\n",
-            fname, errno, strerror(errno));
-    }
-    pclose(pf);
+    if(fname && run_hook)
+        run_pwkey_cmd(fname);
 
-func_return:
-	fflush(stdout);
-	fflush(stderr);
-	return ret;
+    fflush(stdout);
+    fflush(stderr);
+    return ret;
 }
 
 /* ------------------------------------------------------------------------ */
@@ -181,19 +554,15 @@ func_return:
 static int
 turn_display_off(void)
 {
-	if (display_off_disabled || display_state == state_off)
+	if (display_state == state_off)
 		return 0;
 
 	printf("Turning display off.\n");
 	display_state = state_off;
 	fflush(stdout);
 
-#if 0
-#ifdef __arm__
-	gr_save(); /* Qualcomm specific. TODO: implement generic solution. */
-#endif /* __arm__ */
-#endif
-	return sysfs_write_int(display_control, display_control_off_value);
+	/* Blanked, with the screen put aside, once faded out */
+	return brightness_fade(display_control_off_value);
 }
 
 /* ------------------------------------------------------------------------ */
@@ -201,7 +570,73 @@ turn_display_off(void)
 static void
 signal_handler(int sig UNUSED)
 {
-	running = 0;
+	print_stats = 1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+arm_display_off(void)
+{
+	struct itimerspec its;
+
+	if (display_off_fd < 0)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = display_off_time;
+	if (timerfd_settime(display_off_fd, 0, &its, NULL) == -1)
+		errorf("Can't arm the display off timer");
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+display_off_expired(int fd, short revents UNUSED, void *data UNUSED)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0; /* Re-armed since it expired */
+
+	stats.timer++;
+	turn_display_off();
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+open_display_off_timer(void)
+{
+	if (!display_off_time)
+		return 0;
+
+	display_off_fd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (display_off_fd == -1) {
+		errorf("Can't create the display off timer");
+		return -1;
+	}
+
+	if (evloop_add_fd(display_off_fd, display_off_expired, NULL)) {
+		close(display_off_fd);
+		display_off_fd = -1;
+		return -1;
+	}
+
+	arm_display_off();
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+write_stats(void)
+{
+	printf("wakeups: %lu, input: %lu, display off timer: %lu, fade: %lu\n",
+	       stats.wakeups, stats.input, stats.timer, stats.fade);
+	fflush(stdout);
 }
 
 /* ------------------------------------------------------------------------ */
@@ -226,12 +661,9 @@ typedef enum {
 static ret_t
 handle_event(const struct input_event *ev)
 {
+	input_activity = true;
+
 	if (ev->type != EV_KEY || ev->code != KEY_POWER) {
-		/* We are not recalculating timeout value in case of
-		 * "interrupted" key_down state because select() properly
-		 * updates timeout value on return. This behavior of select()
-		 * is Linux-specific, and on other platforms you have to
-		 * recalculate timeout value by your own. */
 		return ret_continue; /* Ignore other events and keys */
 	}
 
@@ -259,32 +691,95 @@ handle_event(const struct input_event *ev)
 
 /* ------------------------------------------------------------------------ */
 
-int
-main(void)
+static void
+usage(void)
 {
-	int fds[MAX_DEVICES], num_fds = 0, ret = EXIT_SUCCESS;
+	printf("Usage: yamui-screensaverd [-t <seconds>] [-f <ms>] [-n <steps>] "
+	       "[-s]\n");
+	printf("-t, --timeout=<seconds>\tTurn the display off after this "
+	       "inactivity period,\n");
+	printf("\t\t\tdefault value: 0, never\n");
+	printf("-f, --fade=<ms>\t\tFade the backlight in and out over this "
+	       "period,\n");
+	printf("\t\t\tdefault value: 0, at once\n");
+	printf("-n, --fade-steps=<steps>\tThe brightness levels of a fade,\n");
+	printf("\t\t\tdefault value: %d\n", DEFAULT_FADE_STEPS);
+	printf("-s, --stats\t\tPrint the wakeup counts at exit and on "
+	       "SIGUSR1\n");
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+screensaverd_option(int opt, const char *arg)
+{
+	switch (opt) {
+	case 't':
+		if ((display_off_time = atoi(arg)) < 0) {
+			printf("Timeout value must not be negative.\n");
+			return -1;
+		}
+
+		break;
+	case 'f':
+		if ((fade_ms = atoi(arg)) < 0) {
+			printf("Fade period must not be negative.\n");
+			return -1;
+		}
+
+		break;
+	case 'n':
+		if ((fade_steps = atoi(arg)) < 1) {
+			printf("Fade steps value must be positive.\n");
+			return -1;
+		}
+
+		break;
+	case 's':
+		show_stats = true;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* The Power key, and for the display off timer the activity: keys and
+ * touches, of which only the contacts, not the moves. */
+static void
+screensaverd_events(event_mask_t *mask)
+{
+	if (!display_off_time) {
+		event_mask_add(mask, EV_KEY, KEY_POWER);
+		return;
+	}
+
+	event_mask_add(mask, EV_KEY, -1);
+	event_mask_add(mask, EV_ABS, ABS_MT_TRACKING_ID);
+}
 
-	setlinebuf(stdout);
-	setlinebuf(stderr);
+/* ------------------------------------------------------------------------ */
 
-	if (open_fds(fds, &num_fds, MAX_DEVICES, check_device_type) == -1)
-		return EXIT_FAILURE;
+static int
+screensaverd_start(void)
+{
+	if (open_display_off_timer() == -1)
+		return -1;
 
 	int have_fb0 = 0;
 	/* the drm backend doesn't support multiple clients */
 	have_fb0 = !access("/dev/fb0", F_OK) || !access("/dev/graphics/fb0", F_OK);
-#if 0
-	if (!have_fb0) {
-#ifdef __arm__
-		/* Qualcomm specific. TODO: implement generic solution. */
-		if (gr_init(false)) {
-			errorf("Failed gr_init().\n");
-			close_fds(fds, num_fds);
-			return EXIT_FAILURE;
-		}
-#endif /* __arm__ */
+	if (getenv(DISPLAY_RESTORE_ENV) &&
+	    strcmp(getenv(DISPLAY_RESTORE_ENV), "0")) {
+		if (restore_init())
+			errorf("Can't open the display, the screen won't be "
+			       "restored");
+		else
+			display_restore = true;
 	}
-#endif
 	
 	if (have_fb0) {
 		printf("framebuffer fb0 found, using it.\n");
@@ -301,77 +796,86 @@ main(void)
 		display_control_on_value = atoi(getenv("DISPLAY_BRIGHTNESS"));
 	}
 	
+	open_brightness();
 	printf("path: %s\nmax brightness: %d\n", display_control,
 		display_control_on_value);
 
 	debugf("Started");
-	signal(SIGINT,  signal_handler);
-	signal(SIGTERM, signal_handler);
+	if (show_stats)
+		signal(SIGUSR1, signal_handler);
 	fflush(stdout);
+	return 0;
+}
 
-	while (running) { /* Main loop */
-		int i, rv, max_fd = 0;
-		fd_set rfds;
-		struct timeval tv;
+/* ------------------------------------------------------------------------ */
 
-		FD_ZERO(&rfds);
-		for (i = 0; i < num_fds; i++) {
-			FD_SET(fds[i], &rfds);
-			if (fds[i] > max_fd)
-				max_fd = fds[i];
-		}
+static ret_t
+screensaverd_wakeup(ret_t r)
+{
+	stats.wakeups++;
+	if (input_activity) {
+		input_activity = false;
+		stats.input++;
+		if (display_state != state_off)
+			arm_display_off();
+	}
 
-		tv.tv_sec  = DISPLAY_OFF_TIME;
-		tv.tv_usec = 0;
-
-		debugf("wait on select(%d) for an event\n", max_fd);
-		rv = select(max_fd + 1, &rfds, NULL, NULL, &tv);
-		if (rv > 0) {
-			ret_t r = ret_continue;
-			for (i = 0; i < num_fds; i++) {
-				if (FD_ISSET(fds[i], &rfds)) {
-				    r = handle_events(fds[i], handle_event);
-				    if (r == ret_continue) {
-				        continue;
-				    } else
-				    if (r == ret_success) {
-				        break;
-				    }
-
-					printf("stop running, fds[%d]: %d, r: %d\n", i, fds[i], r);
-					ret = get_exit_status(r);
-					running = 0;
-					break;
-				}
-			}
-			if (r == ret_success) {
-			    turn_display_on();
-			}
-		} else if (rv == 0) { /* Timeout */
-			turn_display_off();
-		} else { /* Error or signal */
-			if (errno != EINTR) {
-		        fprintf(stderr, "ERROR: select(%d) failed, errno(%d): %s\n",
-		            max_fd, errno, strerror(errno));
-				ret = EXIT_FAILURE;
-			} else {
-			    printf("application interrupted, terminating...\n");
-			}
-			break;
-		}
+	if (print_stats) {
+		print_stats = 0;
+		write_stats();
 	}
 
-	turn_display_on();
-#if 0
-#ifdef __arm__
-	if (have_fb0) {
-		gr_exit(); /* Qualcomm specific. TODO: implement generic solution. */
+	if (r == ret_success) {
+	    turn_display_on(true);
+	    arm_display_off();
+	} else
+	if (r == ret_failure) {
+		printf("stop running, r: %d\n", r);
+		return r;
 	}
-#endif /* __arm__ */
-#endif
-	close_fds(fds, num_fds);
-	printf("Terminated\n");
-	fflush(stdout);
-	fflush(stderr);
-	return ret;
+
+	return ret_continue;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+screensaverd_stop(ret_t r)
+{
+	if (r == ret_continue)
+		printf("application interrupted, terminating...\n");
+
+	fade_ms = 0; /* No loop left to run a fade */
+	turn_display_on(false); /* Nobody would read the hook output */
+	if (display_restore)
+		restore_exit();
+	if (brightness.fd >= 0)
+		close(brightness.fd);
+	if (show_stats)
+		write_stats();
+	return (r == ret_failure) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
+
+/* ------------------------------------------------------------------------ */
+
+static const struct option screensaverd_options[] = {
+	{"timeout",    required_argument, 0, 't'},
+	{"fade",       required_argument, 0, 'f'},
+	{"fade-steps", required_argument, 0, 'n'},
+	{"stats",      no_argument,       0, 's'},
+	{0, 0, 0, 0},
+};
+
+const input_tool_t screensaverd_tool = {
+	.name		= "screensaverd",
+	.optstring	= "t:f:n:s",
+	.options	= screensaverd_options,
+	.usage		= usage,
+	.option		= screensaverd_option,
+	.filter		= check_device_type,
+	.events		= screensaverd_events,
+	.event		= handle_event,
+	.start		= screensaverd_start,
+	.wakeup		= screensaverd_wakeup,
+	.stop		= screensaverd_stop,
+};
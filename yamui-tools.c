@@ -16,21 +16,25 @@
 
 #define _DEFAULT_SOURCE
 
-#include <fcntl.h>
+#include <time.h>
 #include <errno.h>
 #include <stdio.h>
-#include <dirent.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
 #include <sys/types.h>
+#include <sys/timerfd.h>
 
 #include <linux/input.h>
 
 #include "yamui-tools.h"
+#include "minui/minui.h"
 
 extern const char *app_name;
 
@@ -77,45 +81,340 @@ errorf(const char *format, ...)
 
 /* ------------------------------------------------------------------------ */
 
-/* Open all /dev/input/event* files. */
+#define LONG_BITS	(8 * sizeof(long))
+
+void
+event_mask_add(event_mask_t *mask, int type, int code)
+{
+	mask->types[type / LONG_BITS] |= 1UL << (type % LONG_BITS);
+
+	if (code < 0)
+		memset(mask->codes[type], 0xff, sizeof(mask->codes[type]));
+	else
+		mask->codes[type][code / LONG_BITS] |= 1UL << (code % LONG_BITS);
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+event_mask_merge(event_mask_t *to, const event_mask_t *from)
+{
+	unsigned long *t = (unsigned long *)to;
+	const unsigned long *f = (const unsigned long *)from;
+	size_t i;
+
+	for (i = 0; i < sizeof(*to) / sizeof(long); i++)
+		t[i] |= f[i];
+}
+
+/* ------------------------------------------------------------------------ */
+
+bool
+event_mask_test(const event_mask_t *mask, const struct input_event *ev)
+{
+	if (ev->type >= EV_CNT || ev->code >= KEY_CNT)
+		return false;
+
+	return (mask->codes[ev->type][ev->code / LONG_BITS] >>
+		(ev->code % LONG_BITS)) & 1;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Returns -1 with errno EINVAL if the kernel lacks EVIOCSMASK, before 4.4,
+ * then all the events keep coming. */
+int
+event_mask_set(int fd, const event_mask_t *mask)
+{
+	unsigned long types[MASK_LONGS(EV_CNT)];
+	struct input_mask im;
+	int type;
+
+	/* The mask of type 0 is the one of the types. EV_SYN stays: readers
+	 * are woken up by SYN_REPORT, the empty packets are dropped. */
+	memcpy(types, mask->types, sizeof(types));
+	types[EV_SYN / LONG_BITS] |= 1UL << (EV_SYN % LONG_BITS);
+
+	im.type = 0;
+	im.codes_size = sizeof(types);
+	im.codes_ptr = (unsigned long)types;
+	if (ioctl(fd, EVIOCSMASK, &im) == -1)
+		return -1;
+
+	for (type = 1; type < EV_CNT; type++) {
+		if (!((types[type / LONG_BITS] >> (type % LONG_BITS)) & 1))
+			continue;
+
+		im.type = type;
+		im.codes_size = sizeof(mask->codes[type]);
+		im.codes_ptr = (unsigned long)mask->codes[type];
+		if (ioctl(fd, EVIOCSMASK, &im) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+static event_handler_t input_handler;
+static ret_t input_ret = ret_continue;
+
+static int
+input_ready(int fd, short revents UNUSED, void *data UNUSED)
+{
+	ret_t r;
+
+	/* The first outcome other than continue ends the wait */
+	if (input_ret == ret_continue &&
+	    (r = handle_events(fd, input_handler)) != ret_continue)
+		input_ret = r;
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Watch the /dev/input/event* devices that device_filter accepts, now and
+ * when they show up later, and pass their events to event_handler. */
 int
-open_fds(int fds[], int *num, int max_num, device_filter_t device_filter)
+open_input(device_filter_t device_filter, event_handler_t event_handler)
 {
-	DIR *dir;
-	struct dirent *d;
+	input_handler = event_handler;
 
-	if (!(dir = opendir(DEV_INPUT_DIR))) {
-		errorf("Can't open directory %s", DEV_INPUT_DIR);
+	if (evloop_init() ||
+	    evloop_watch_input(device_filter, input_ready, NULL)) {
+		errorf("Can't watch the input devices");
 		return -1;
 	}
 
-	while ((d = readdir(dir))) {
-		char name[256];
+	return 0;
+}
 
-		if (strncmp(d->d_name, EVENT_PREFIX, strlen(EVENT_PREFIX)))
-			continue; /* Not /dev/input/event* file */
+/* ------------------------------------------------------------------------ */
 
-		if (snprintf(name, sizeof name, "%s/%s", DEV_INPUT_DIR,
-			 d->d_name) >= (int)sizeof name)
-			continue;
-		debugf("Processing input ivents file %s", name);
-		if ((fds[*num] = open(name, O_RDONLY)) == -1) {
-			errorf("Can't open input device %s", name);
-			continue;
+void
+close_input(void)
+{
+	evloop_exit();
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Wait up to timeout ms, forever if negative, and handle the events of the
+ * fds ready. Returns their number, 0 on timeout or -1 on error with errno
+ * set; *r is the outcome of the input events, ret_continue if none. */
+int
+wait_input(int timeout, ret_t *r)
+{
+	int n;
+
+	input_ret = ret_continue;
+	if ((n = evloop_wait(timeout)) > 0)
+		evloop_dispatch();
+
+	*r = input_ret;
+	return n;
+}
+
+/* ------------------------------------------------------------------------ */
+
+#ifndef input_event_sec /* Before 4.16 */
+#define input_event_sec		time.tv_sec
+#define input_event_usec	time.tv_usec
+#endif
+
+typedef long long int nsec_t;
+
+static struct {
+	gesture_config_t config;
+	gesture_handler_t handler;
+	int timer_fd;
+	enum {
+		power_up,
+		power_down,	/* until the long press deadline */
+		power_long,	/* held past it */
+		power_released,	/* until the double press deadline */
+		power_done,	/* a gesture of this press was told */
+	} state;
+	nsec_t down, up;	/* of the Power key */
+	nsec_t chord_down;	/* of chord_key, -1 if it is up */
+	bool expired;
+} gesture = { .timer_fd = -1, .chord_down = -1 };
+
+static const char *const gesture_names[] = {
+	[gesture_press]		= "press",
+	[gesture_long_press]	= "long press",
+	[gesture_long_release]	= "long press release",
+	[gesture_double_press]	= "double press",
+	[gesture_chord]		= "chord",
+};
+
+/* ------------------------------------------------------------------------ */
+
+const char *
+gesture_name(gesture_t g)
+{
+	return gesture_names[g];
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* Arm the timer at the event time t plus ms, disarm it if ms is 0 */
+static void
+gesture_arm(nsec_t t, int ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (ms) {
+		t += ms * 1000000LL;
+		its.it_value.tv_sec = t / 1000000000;
+		its.it_value.tv_nsec = t % 1000000000;
+	}
+
+	gesture.expired = false;
+	if (timerfd_settime(gesture.timer_fd, TFD_TIMER_ABSTIME, &its, NULL))
+		errorf("Can't arm the gesture timer");
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+gesture_told(gesture_t g, int next_state)
+{
+	gesture.state = next_state;
+	debugf("Gesture: %s", gesture_name(g));
+	gesture.handler(g);
+}
+
+/* ------------------------------------------------------------------------ */
+
+/* The expiry is only noted: its gesture is told after the dispatch, once
+ * the events read in the same wait, maybe older, are handled. */
+static int
+gesture_expired(int fd, short revents UNUSED, void *data UNUSED)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+		gesture.expired = true;
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+gesture_wakeup(void)
+{
+	if (!gesture.expired)
+		return;
+
+	gesture.expired = false;
+	if (gesture.state == power_down)
+		gesture_told(gesture_long_press, power_long);
+	else if (gesture.state == power_released)
+		gesture_told(gesture_press, power_up);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static void
+gesture_power(nsec_t t, bool down)
+{
+	const gesture_config_t *c = &gesture.config;
+
+	if (down) {
+		/* The deadline of the previous press may be still pending */
+		if (gesture.state == power_released &&
+		    t - gesture.up > c->double_ms * 1000000LL)
+			gesture_told(gesture_press, power_up);
+
+		if (gesture.state == power_released) {
+			gesture_arm(0, 0);
+			gesture_told(gesture_double_press, power_done);
+		} else if (gesture.state != power_up) {
+			return; /* Another Power key */
+		} else if (gesture.chord_down >= 0 &&
+			   t - gesture.chord_down <= c->chord_ms * 1000000LL) {
+			gesture_told(gesture_chord, power_done);
+		} else {
+			gesture.state = power_down;
+			gesture.down = t;
+			gesture_arm(t, c->long_ms);
 		}
+		return;
+	}
 
-		if (device_filter && device_filter(fds[*num], name) == -1) {
-			close(fds[*num]);
-			continue;
+	switch (gesture.state) {
+	case power_down:
+		gesture_arm(0, 0);
+		if (c->long_ms && t - gesture.down >= c->long_ms * 1000000LL) {
+			gesture_told(gesture_long_press, power_long);
+			gesture_told(gesture_long_release, power_up);
+		} else if (c->double_ms) {
+			gesture.state = power_released;
+			gesture.up = t;
+			gesture_arm(t, c->double_ms);
+		} else {
+			gesture_told(gesture_press, power_up);
+		}
+		break;
+	case power_long:
+		gesture_told(gesture_long_release, power_up);
+		break;
+	case power_done:
+		gesture.state = power_up;
+		break;
+	default: /* Another Power key */
+		break;
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+
+void
+gesture_event(const struct input_event *ev)
+{
+	nsec_t t;
+
+	if (ev->type != EV_KEY || ev->value > 1)
+		return; /* Not a key, or an autorepeat */
+
+	t = ev->input_event_sec * 1000000000LL + ev->input_event_usec * 1000LL;
+
+	if (ev->code == KEY_POWER) {
+		gesture_power(t, ev->value);
+	} else if (gesture.config.chord_key &&
+		   ev->code == gesture.config.chord_key) {
+		gesture.chord_down = ev->value ? t : -1;
+		if (ev->value && gesture.state == power_down &&
+		    t - gesture.down <= gesture.config.chord_ms * 1000000LL) {
+			gesture_arm(0, 0);
+			gesture_told(gesture_chord, power_done);
 		}
+	}
+}
+
+/* ------------------------------------------------------------------------ */
 
-		if (++*num >= max_num)
-			break;
+int
+gesture_init(const gesture_config_t *config, gesture_handler_t handler)
+{
+	gesture.config = *config;
+	gesture.handler = handler;
+
+	gesture.timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+	if (gesture.timer_fd == -1) {
+		errorf("Can't create the gesture timer");
+		return -1;
 	}
 
-	closedir(dir);
-	if (!*num) {
-		infof("No suitable input events devices found.");
+	if (evloop_add_fd(gesture.timer_fd, gesture_expired, NULL)) {
+		close(gesture.timer_fd);
+		gesture.timer_fd = -1;
 		return -1;
 	}
 
@@ -124,13 +423,24 @@ open_fds(int fds[], int *num, int max_num, device_filter_t device_filter)
 
 /* ------------------------------------------------------------------------ */
 
-void
-close_fds(int fds[], int num)
+/* The devices left on CLOCK_REALTIME, by fd: set on each open, as the fd of
+ * a device unplugged may be reused by the next one. */
+static fd_set input_realtime;
+
+int
+input_set_clock(int fd)
 {
-	int i;
+	int clock = CLOCK_MONOTONIC, ret;
+
+	ret = ioctl(fd, EVIOCSCLOCKID, &clock);
+	if (fd < FD_SETSIZE) {
+		if (ret == -1)
+			FD_SET(fd, &input_realtime);
+		else
+			FD_CLR(fd, &input_realtime);
+	}
 
-	for (i = 0; i < num; i++)
-		close(fds[i]);
+	return ret;
 }
 
 /* ------------------------------------------------------------------------ */
@@ -149,7 +459,9 @@ handle_events(int fd, event_handler_t event_handler)
 
 	/* Read and ignore event data if OK. */
 	rv = read(fd, (void *)buf, sizeof(buf));
-	if (rv < 0) {
+	if (rv < 0 && (errno == EAGAIN || errno == ENODEV)) {
+		return ret_continue; /* Spurious or unplugged, it is removed */
+	} else if (rv < 0) {
 		errorf("Error on read");
 		return ret_failure;
 	} else if (rv == 0) {
@@ -160,6 +472,18 @@ handle_events(int fd, event_handler_t event_handler)
 		return ret_failure;
 	}
 
+	/* Stamped on read instead, later than the kernel but on the clock of
+	 * the timers */
+	if (fd < FD_SETSIZE && FD_ISSET(fd, &input_realtime)) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		for (i = 0; i < rv / sizeof(struct input_event); i++) {
+			buf[i].input_event_sec = ts.tv_sec;
+			buf[i].input_event_usec = ts.tv_nsec / 1000;
+		}
+	}
+
 	if (event_handler)
 		for (i = 0; i < rv / sizeof(struct input_event); i++)
 			if ((ret = event_handler(&buf[i])) != ret_continue)
@@ -19,6 +19,9 @@
 #define _YAMUI_TOOLS_H_
 
 #include <stdio.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
 
 #include <linux/input.h>
 
@@ -45,13 +48,9 @@ debugf(const char *format UNUSED, ...)
 
 #endif /* !DEBUG */
 
-#define DEV_INPUT_DIR	"/dev/input"
-#define EVENT_PREFIX	"event"
 #define EVENTS_BUF_SIZE	512 /* events */
 
 typedef int (*device_filter_t)(int fd, const char *name);
-int open_fds(int fds[], int *num, int max_num, device_filter_t device_filter);
-void close_fds(int fds[], int num);
 
 typedef enum {
 	ret_success,
@@ -64,4 +63,103 @@ int get_exit_status(ret_t r);
 typedef ret_t (*event_handler_t)(const struct input_event *ev);
 ret_t handle_events(int fd, event_handler_t event_handler);
 
+/* The events wanted, set in the kernel with EVIOCSMASK so that the others
+ * do not even wake the reader up, and tested in user space as well for the
+ * kernels without it and for the tools sharing a device. */
+#define MASK_LONGS(bits)	(((bits) + 8 * sizeof(long) - 1) / \
+				 (8 * sizeof(long)))
+
+typedef struct {
+	unsigned long types[MASK_LONGS(EV_CNT)];
+	unsigned long codes[EV_CNT][MASK_LONGS(KEY_CNT)];
+} event_mask_t;
+
+void event_mask_add(event_mask_t *mask, int type, int code); /* -1: all */
+void event_mask_merge(event_mask_t *to, const event_mask_t *from);
+bool event_mask_test(const event_mask_t *mask, const struct input_event *ev);
+int event_mask_set(int fd, const event_mask_t *mask);
+
+/* Has the device stamp its events on CLOCK_MONOTONIC, the clock of the
+ * gesture timers. Returns -1 if it can't, its events are then stamped on
+ * read by handle_events(). */
+int input_set_clock(int fd);
+
+int open_input(device_filter_t device_filter, event_handler_t event_handler);
+void close_input(void);
+int wait_input(int timeout, ret_t *r);
+
+/* Gestures of the Power key, told from the kernel timestamps of the events,
+ * CLOCK_MONOTONIC ones, and a timerfd armed only for a pending deadline: no
+ * wakeup while idle and no drift with the load. */
+typedef enum {
+	gesture_press,		/* a short one, not followed by another */
+	gesture_long_press,	/* held for long_ms, at its deadline */
+	gesture_long_release,	/* the release of a long press */
+	gesture_double_press,	/* again within double_ms of the release */
+	gesture_chord,		/* with chord_key, within chord_ms */
+} gesture_t;
+
+typedef struct {
+	int long_ms;		/* 0: no long press */
+	int double_ms;		/* 0: no double press, presses at release */
+	int chord_ms;
+	int chord_key;		/* 0: no chord */
+} gesture_config_t;
+
+typedef void (*gesture_handler_t)(gesture_t gesture);
+
+int gesture_init(const gesture_config_t *config, gesture_handler_t handler);
+void gesture_event(const struct input_event *ev);
+void gesture_wakeup(void);	/* after the dispatch, for the deadlines */
+const char *gesture_name(gesture_t gesture);
+
+/* A tool of yamui-inputd, run alone by its personality yamui-<name> or with
+ * the others by yamui-inputd: the input devices that any of them accepts are
+ * opened once and each event goes to all of them. */
+typedef struct {
+	const char *name;
+	const char *optstring;		/* of getopt(), -h is common */
+	const struct option *options;	/* of getopt_long(), or NULL */
+	void (*usage)(void);
+	int (*option)(int opt, const char *arg);	/* -1 if invalid */
+	device_filter_t filter;		/* 0 if the device is wanted */
+	void (*events)(event_mask_t *mask);	/* wanted, after the options */
+	event_handler_t event;		/* no more events once done */
+	int (*start)(void);		/* with the devices open, -1 on error */
+	ret_t (*wakeup)(ret_t r);	/* after each wait, r of its events */
+	int (*stop)(ret_t r);		/* exit status, ret_continue on signal */
+} input_tool_t;
+
+extern const input_tool_t powerkey_tool;
+extern const input_tool_t screensaverd_tool;
+
+/* The screen saved before the display off and shown again after it, in
+ * yamui-restore.c, which links the minui graphics: only with make
+ * DISPLAY_RESTORE=1, else restore_init() fails with ENOSYS. */
+#ifdef YAMUI_DISPLAY_RESTORE
+
+int restore_init(void);		/* -1 on error */
+void restore_save(void);	/* and blank the display */
+void restore_show(void);
+void restore_exit(void);
+
+#else /* !YAMUI_DISPLAY_RESTORE */
+
+#include <errno.h>
+
+static __inline__ int
+restore_init(void)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+static __inline__ void restore_save(void) { }
+static __inline__ void restore_show(void) { }
+static __inline__ void restore_exit(void) { }
+
+#endif /* !YAMUI_DISPLAY_RESTORE */
+
+extern sig_atomic_t volatile running;
+
 #endif /* _YAMUI_TOOLS_H_ */
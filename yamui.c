@@ -30,6 +30,7 @@
 #include <sys/select.h>
 
 #include "os-update.h"
+#include "trace.h"
 #include "minui/graphics.h"
 
 #define MSTIME_HEADER_ONLY
@@ -46,18 +47,25 @@ static struct option options[] = {
 	{"stopafter",   required_argument, 0, 's'},
 	{"text",        required_argument, 0, 't'},
 	{"fontmultipl", required_argument, 0, 'm'},
+	{"fontfile",    required_argument, 0, 'f'},
 	{"xpos",        required_argument, 0, 'x'},
 	{"ypos",        required_argument, 0, 'x'},
+	{"backend",     required_argument, 0, 'b'},
+	{"stats",       required_argument, 0, 'S'},
+	{"overlay",     no_argument,       0, 'o'},
 	{"cleanup",     no_argument,       0, 'k'},
 	{"help",        no_argument,       0, 'h'},
 	{0, 0, 0, 0},
 };
 
 static bool do_cleanup = false;
+static const char *stats_path = NULL;
+static char **app_text = NULL;
+static int app_text_count = 0;
 static long long int app_font_multipl = 0;
 static long long int app_text_xpos = 0, app_text_ypos = 0;
 
-long long int v_shift = 0;
+extern long long int v_shift;
 
 #define basename (argv_ptr[get_my_basename_index()])
 
@@ -65,21 +73,48 @@ static char **argv_ptr = NULL;
 
 /* ------------------------------------------------------------------------ */
 
+/* SIGUSR1 prints the frame statistics and the wait goes on for the time
+ * left, any other signal interrupts it. */
 static int __attribute__((unused))
 _wait_signalfd(int sigfd, unsigned long long int msecs)
 {
 	int ret;
 	fd_set fdset;
-	struct timespec ts = {
-		.tv_sec = msecs / 1000,
-		.tv_nsec = (msecs % 1000) * 1000000
-	};
+	struct signalfd_siginfo si;
+	struct timespec ts, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += msecs / 1000 + (end.tv_nsec + (msecs % 1000) * 1000000) /
+		      1000000000;
+	end.tv_nsec = (end.tv_nsec + (msecs % 1000) * 1000000) % 1000000000;
+
+	for (;;) {
+		FD_ZERO(&fdset);
+		if (sigfd >= 0)
+			FD_SET(sigfd, &fdset);
+
+		if (msecs) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_sec = end.tv_sec - ts.tv_sec;
+			ts.tv_nsec = end.tv_nsec - ts.tv_nsec;
+			if (ts.tv_nsec < 0) {
+				ts.tv_sec--;
+				ts.tv_nsec += 1000000000;
+			}
+			if (ts.tv_sec < 0)
+				return 0;
+		}
 
-	FD_ZERO(&fdset);
-	if (sigfd >= 0)
-		FD_SET(sigfd, &fdset);
+		ret = pselect(sigfd + 1, &fdset, NULL, NULL, msecs ? &ts : NULL,
+			      NULL);
+		if (ret > 0 && read(sigfd, &si, sizeof(si)) == sizeof(si) &&
+		    si.ssi_signo == SIGUSR1) {
+			gr_stats_write(stats_path);
+			continue;
+		}
+		break;
+	}
 
-	ret = pselect(sigfd + 1, &fdset, NULL, NULL, msecs ? &ts : NULL, NULL);
 	if (ret > 0)
 		printf("Interrupted, bailing out\n");
 	else if (ret == -1)
@@ -140,7 +175,8 @@ print_help(void)
 	printf("    IMAGE(s)   - images in PNG format with .png extention which file\n");
 	printf("                 names can be found in DIR without the .png extension.\n");
 	printf("                 The maximum of %d pictures is supported.\n", IMAGES_MAX);
-	printf("    STRING(s)  - text strings composed by printable chars, %d max rows\n", TXTRWS_MAX);
+	printf("    STRING(s)  - UTF-8 text strings, %d max rows; the characters that\n", TXTRWS_MAX);
+	printf("                 the font lacks are taken from /res/images/font.psf\n");
 	printf("\n");
 	printf("    OPTIONS:\n");
 	printf("\n");
@@ -153,15 +189,27 @@ print_help(void)
 	printf("  --stopafter=TIME, -s TIME\n");
 	printf("         Stop showing the IMAGE(s) after TIME milliseconds\n");
 	printf("  --text=STRING, -t STRING\n");
-	printf("         Show STRING on the screen, multiple times for each row\n");
+	printf("         Show STRING on the screen, multiple times for each paragraph\n");
+	printf("         which is wrapped to the screen width\n");
 	printf("  --fontmultipl=FACTOR, -m FACTOR\n");
 	printf("         Increase the font size by a factor between 1 and 16\n");
+	printf("  --fontfile=FILE, -f FILE\n");
+	printf("         Draw the text with the PSF console font in FILE\n");
 	printf("  --xpos=THOUSANDTHS, -x THOUSANDTHS\n");
 	printf("         Set the text horizontal center to x/1000 of the screen width\n");
 	printf("  --ypos=THOUSANDTHS, -y THOUSANDTHS\n");
 	printf("         Set the text vertical origin to y/1000 of the screen height\n");
 	printf("  --vshift=THOUSANDTHS, -v THOUSANDTHS\n");
 	printf("         Set the vertical shift to v/1000 of the screen height\n");
+	printf("  --backend=NAME, -b NAME\n");
+	printf("         Draw with the drm, fbdev or mem graphics backend, the latter\n");
+	printf("         is headless and set up with YAMUI_MEM, see the README\n");
+	printf("  --stats=FILE, -S FILE\n");
+	printf("         Write the frame timing statistics to FILE, - for stdout,\n");
+	printf("         at exit; SIGUSR1 prints them at any time\n");
+	printf("  --overlay, -o\n");
+	printf("         Draw over what the screen shows, e.g. the bootloader splash,\n");
+	printf("         instead of clearing it first\n");
 	printf("  --cleanup, -k\n");
 	printf("         Exit closing and freeing resources but the kernel does it\n");
 	printf("  --help, -h\n");
@@ -171,16 +219,32 @@ print_help(void)
 
 /* ------------------------------------------------------------------------ */
 
-/* Add text to both sides of the "flip" */
+/* Draw the text, each STRING is a paragraph wrapped to the screen width.
+ * It is also the overlay of the logo and of the progress bar, drawn once in
+ * each buffer because the anti-aliased edges can't be blended twice. */
 static void
-add_text(char **text, int count)
+draw_text(void)
 {
-	if (!text || !count)
+	int row = 0;
+	int width = gr_fb_width() - 2 * ABSOLUTE_DISPLAY_MARGIN_X;
+	gr_align align = (app_text_xpos < 0) ? GR_ALIGN_LEFT : GR_ALIGN_CENTER;
+
+	if (!app_text || !app_text_count)
 		return;
 
-	for(int i = 0; i < count; i++)
-	    gr_text(app_text_xpos, app_text_ypos, text[i], 1, app_font_multipl, i);
+	gr_color(255, 255, 255, 255);
+	for(int i = 0; i < app_text_count; i++)
+	    row += gr_layout_draw(gr_layout_text(app_text[i], app_font_multipl,
+	        width, align, 0), app_text_xpos, app_text_ypos, 1, row);
+}
 
+/* ------------------------------------------------------------------------ */
+
+/* Show the text alone */
+static void
+add_text(void)
+{
+	draw_text();
 //	gr_copy();
 	gr_flip();
 }
@@ -191,6 +255,8 @@ int
 main(int argc, char *argv[])
 {
 	bool blank = false;
+	bool overlay = false;
+	bool shown = false;
 	int c, option_index;
 	unsigned long int animate_ms = 0;
 	unsigned long long int stop_ms = 0;
@@ -198,6 +264,7 @@ main(int argc, char *argv[])
 	char * text[512];
 	char * images[IMAGES_MAX];
 	char * images_dir = "/res/images";
+	char * font_file = NULL;
 	int image_count = 0, text_count = 0;
 	int ret = 0;
 	int i = 0;
@@ -219,7 +286,7 @@ main(int argc, char *argv[])
 #endif
 
 	while (1) {
-		c = getopt_long(argc, argv, "a:i:p:s:t:m:x:y:v:kh", options,
+		c = getopt_long(argc, argv, "a:i:p:s:t:m:f:x:y:v:b:S:okh", options,
 				&option_index);
 		if (c == -1)
 			break;
@@ -229,6 +296,18 @@ main(int argc, char *argv[])
 			printf("got animate %s ms\n", optarg);
 			animate_ms = strtoul(optarg, (char **)NULL, 10);
 			break;
+		case 'b':
+			printf("got backend \"%s\"\n", optarg);
+			gr_set_backend(optarg);
+			break;
+		case 'S':
+			printf("got stats file \"%s\"\n", optarg);
+			stats_path = optarg;
+			break;
+		case 'o':
+			printf("draw over the screen content\n");
+			overlay = true;
+			break;
 		case 'k':
 			printf("clean up resources\n");
 			do_cleanup = true;
@@ -260,6 +339,10 @@ main(int argc, char *argv[])
             printf("got font %s multipier\n", optarg);
             app_font_multipl = strtoull(optarg, NULL, 10);
             break;
+        case 'f':
+            printf("got font file \"%s\"\n", optarg);
+            font_file = optarg;
+            break;
         case 'x':
             printf("got text x-pos: %s/1000\n", optarg);
             app_text_xpos = strtoull(optarg, NULL, 10);
@@ -303,11 +386,28 @@ main(int argc, char *argv[])
 
 	get_ms_time_rst();
 
+	/* The font is set up and the images are decoded on a helper thread
+	 * while the display is probed and initialised */
+	osUpdatePreload(images, image_count, images_dir,
+	    text_count ? font_file : NULL, text_count > 0);
+
+	/* Never blanking, the panel would be powered down and up again: the
+	 * buffers inherit the screen content or, to draw on black, are zeroed */
+	gr_set_inherit(!blank || overlay);
+	TRACE_BEGIN("init");
 	if (osUpdateScreenInit(0))
 		return -1;
+	TRACE_END("init");
 
     get_ms_time_lbl(__FILE__":init"); //RAF: 0.366s are spent in initialisation
 
+    TRACE_BEGIN("preload wait");
+    if (osUpdatePreloadWait())
+        printf("Font \"%s\" not loaded, using the built-in one\n", font_file);
+    TRACE_END("preload wait");
+
+    get_ms_time_lbl(__FILE__":load");
+
     if (!blank) {
 #if 0 //RAF, TODO: until restore will work this is useless
 	    printf("Restore the screen buffer and sleep 2s...\n");
@@ -325,10 +425,12 @@ main(int argc, char *argv[])
         printf("real v-shift is %lld pixels\n", v_shift);
     }
 
-	/* Allow SIGTERM and SIGINT to interrupt pselect() and move to cleanup */
+	/* Allow SIGTERM and SIGINT to interrupt pselect() and move to cleanup,
+	 * SIGUSR1 to print the frame statistics */
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGINT);
     sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
 	sigfd = signalfd(-1, &mask, 0);
 	if (sigfd == -1) {
 		printf("Could not create signal fd\n");
@@ -341,11 +443,11 @@ main(int argc, char *argv[])
 
 	gr_color(255, 255, 255, 255);
 
-	/* In case there is text to add, add it to both sides of the "flip" */
-	if(text_count && (animate_ms || progress_ms)) {
-	    get_ms_time_rst();
-	    add_text(text, text_count);
-	    get_ms_time_lbl(__FILE__":text");
+	/* In case there is text to add, draw it on every frame shown */
+	if(text_count) {
+	    app_text = text;
+	    app_text_count = text_count;
+	    osUpdateScreenSetOverlay(draw_text);
 	}
 
 	if (animate_ms && image_count > 1) {
@@ -355,6 +457,7 @@ main(int argc, char *argv[])
 		long time_left = (stop_ms < imgcnt) ? imgcnt : stop_ms;
 
 		period = INT_DIV(period, image_count);
+		gr_stats_period(period);
 
 		get_ms_time_rst();
 
@@ -402,6 +505,7 @@ main(int argc, char *argv[])
             wtme = progress_ms/10;
             step = 10;
         }
+        gr_stats_period(wtme);
         for (i = 0; i <= 100; i += step) {
             osUpdateScreenShowProgress(i);
             if (wait_signalfd(sigfd, wtme))
@@ -428,14 +532,14 @@ main(int argc, char *argv[])
 		if(loadLogo(images[0], images_dir))
 			printf("Image \"%s\" not found in /res/images/\n", images[0]);
         else
-		    showLogo();
+		    shown = !showLogo();
 
 		get_ms_time_lbl(__FILE__":logo");
 	}
 
-	/* In case there is text to add, add it to both sides of the "flip" */
-	if(text_count) {
-	    add_text(text, text_count);
+	/* In case there is text to add and no logo shown with it */
+	if(text_count && !shown) {
+	    add_text();
 	    get_ms_time_lbl(__FILE__":text");
 	}
 
@@ -457,6 +561,8 @@ saving:
     gr_exit();
 #endif
 out:
+	if (stats_path)
+	    gr_stats_write(stats_path);
 	get_ms_time_lbl(__FILE__":exit");
 	fflush(stdout);
 	fflush(stderr);